@@ -0,0 +1,63 @@
+#!/bin/sh
+#
+# imgcssmap benchmark. Generates the synthetic sets of images (once),
+# builds each one with each packing algorithm, and writes the statistics
+# of the runs in BENCH_OUT, one JSON object per line.
+#
+#   BENCH_SIZES  number of images of the sets, "1000 10000" by default.
+#                The photos sets have 10 times less images.
+#   BENCH_DIR    directory of the sets, bench/corpus by default
+#   BENCH_OUT    results, bench/results.jsonl by default
+#   BENCH_OPTS   more imgcssmap options, "-j 0" by default
+#
+
+set -e
+
+SIZES=${BENCH_SIZES:-"1000 10000"}
+DIR=${BENCH_DIR:-bench/corpus}
+OUT=${BENCH_OUT:-bench/results.jsonl}
+OPTS=${BENCH_OPTS:-"-j 0"}
+
+: > "$OUT"
+for size in $SIZES; do
+	for kind in glyphs mixed padded photos; do
+		count=$size
+		if [ "$kind" = photos ]; then
+			count=$((size / 10))
+		fi
+		set="$DIR/$kind-$count"
+		if [ ! -f "$set/list" ]; then
+			mkdir -p "$set"
+			./bench/mkcorpus "$kind" "$count" "$set"
+		fi
+
+		# the padding is removed by the crop
+		crop=""
+		if [ "$kind" = padded ]; then
+			crop="-c"
+		fi
+
+		for pack in firstfit skyline maxrects; do
+
+			# the first-fit scan is too slow on the big sets
+			if [ "$pack" = firstfit ] && [ "$count" -gt 20000 ]; then
+				continue
+			fi
+
+			start=$(date +%s%N)
+			./imgcssmap $OPTS $crop -p $pack --stats "$DIR/stats.json" \
+				-o "$DIR/out.png" -t test_files/a.css.tpl "$DIR/out.css" \
+				-l "$set/list" 2>/dev/null
+			end=$(date +%s%N)
+
+			printf '{"set":"%s","images":%d,"pack":"%s","options":"%s","total_ms":%d,"stats":%s}\n' \
+				"$kind" "$count" "$pack" "$(echo $OPTS $crop)" $(((end - start) / 1000000)) \
+				"$(tr -d '\n' < "$DIR/stats.json")" >> "$OUT"
+			printf '%-7s %7d %-9s %7d ms  fill %s  png %s bytes\n' \
+				"$kind" "$count" "$pack" $(((end - start) / 1000000)) \
+				"$(sed -n 's/.*"fill": \([0-9.]*\).*/\1/p' "$DIR/stats.json")" \
+				"$(sed -n 's/.*"png_bytes": \([0-9]*\).*/\1/p' "$DIR/stats.json")"
+		done
+	done
+done
+echo "results in $OUT"
@@ -0,0 +1,331 @@
+/*
+ * Copyright (c) 2011-2012 Thierry FOURNIER
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License.
+ *
+ */
+
+/*
+ * Generator of synthetic sets of images for the benchmark. The same
+ * kind, number and seed always give the same images.
+ *
+ *   mkcorpus kind count dir [seed]
+ *
+ * The images are written in <dir>, with the list of their names in
+ * <dir>/list, usable with "imgcssmap -l".
+ */
+
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <png.h>
+
+enum kind {
+	KIND_GLYPHS,   /* icons of the same size, one color and alpha */
+	KIND_MIXED,    /* mixed sizes, mostly small, with alpha */
+	KIND_PHOTOS,   /* opaque pictures, noisy */
+	KIND_PADDED,   /* small glyphs in big transparent images */
+};
+
+struct image {
+	int width;
+	int height;
+	unsigned char *pix;   /* RGBA */
+};
+
+uint64_t rnd_state;
+
+/* xorshift64* */
+static inline
+uint32_t rnd(void)
+{
+	rnd_state ^= rnd_state >> 12;
+	rnd_state ^= rnd_state << 25;
+	rnd_state ^= rnd_state >> 27;
+	return (rnd_state * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+/* random value in [min, max] */
+static inline
+int rnd_range(int min, int max)
+{
+	return min + rnd() % (max - min + 1);
+}
+
+void image_new(struct image *img, int width, int height)
+{
+	img->width = width;
+	img->height = height;
+	img->pix = calloc(4, (size_t)width * height);
+	if (img->pix == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+}
+
+/* blend the color <c> with the coverage <cov> (0 to 1) on the pixel x, y */
+static inline
+void image_blend(struct image *img, int x, int y, const unsigned char *c, double cov)
+{
+	unsigned char *p = &img->pix[((size_t)y * img->width + x) * 4];
+	double a = cov * c[3] / 255.0;
+	int i;
+
+	if (a <= 0)
+		return;
+	for (i=0; i<3; i++)
+		p[i] = c[i] * a + p[i] * (1 - a);
+	p[3] = 255 * (a + p[3] / 255.0 * (1 - a));
+}
+
+/* one glyph of random discs, rings and bars, in the box x, y, w, h. The
+ * edges are antialiased with 4x4 samples by pixel.
+ */
+void draw_glyph(struct image *img, int bx, int by, int bw, int bh, const unsigned char *c)
+{
+	double cx[4], cy[4], r0[4], r1[4];
+	int type[4];
+	int nb;
+	int x, y, sx, sy, k;
+	double px, py, d;
+	int in;
+	int cov;
+
+	nb = rnd_range(1, 4);
+	for (k=0; k<nb; k++) {
+		type[k] = rnd() % 3;
+		cx[k] = bx + bw * (0.2 + 0.6 * (rnd() % 1000) / 1000.0);
+		cy[k] = by + bh * (0.2 + 0.6 * (rnd() % 1000) / 1000.0);
+		r1[k] = (bw < bh ? bw : bh) * (0.15 + 0.3 * (rnd() % 1000) / 1000.0);
+		r0[k] = r1[k] * 0.6;
+	}
+
+	for (y=by; y<by+bh; y++) {
+		for (x=bx; x<bx+bw; x++) {
+			cov = 0;
+			for (sy=0; sy<4; sy++) {
+				for (sx=0; sx<4; sx++) {
+					px = x + (sx + 0.5) / 4;
+					py = y + (sy + 0.5) / 4;
+					in = 0;
+					for (k=0; k<nb && !in; k++) {
+						d = hypot(px - cx[k], py - cy[k]);
+						/**/ if (type[k] == 0)
+							in = d <= r1[k];
+						else if (type[k] == 1)
+							in = d <= r1[k] && d >= r0[k];
+						else
+							in = fabs(px - cx[k]) <= r1[k] &&
+							     fabs(py - cy[k]) <= r1[k] / 3;
+					}
+					cov += in;
+				}
+			}
+			image_blend(img, x, y, c, cov / 16.0);
+		}
+	}
+}
+
+/* smooth gradients, waves and noise, all opaque */
+void draw_photo(struct image *img)
+{
+	double f[3], ph[3];
+	unsigned char *p;
+	int base[3][3];
+	int x, y, i, v;
+
+	for (i=0; i<3; i++) {
+		base[i][0] = rnd() % 256;
+		base[i][1] = rnd() % 256;
+		base[i][2] = rnd() % 256;
+		f[i] = 0.02 + (rnd() % 1000) / 4000.0;
+		ph[i] = (rnd() % 1000) / 100.0;
+	}
+	for (y=0; y<img->height; y++) {
+		for (x=0; x<img->width; x++) {
+			p = &img->pix[((size_t)y * img->width + x) * 4];
+			for (i=0; i<3; i++) {
+				v = base[0][i] + (base[1][i] - base[0][i]) * x / img->width +
+				    (base[2][i] - base[0][i]) * y / img->height / 2 +
+				    24 * sin(f[i] * (x + y) + ph[i]) +
+				    (int)(rnd() % 17) - 8;
+				p[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+			}
+			p[3] = 255;
+		}
+	}
+}
+
+void make_image(struct image *img, enum kind kind)
+{
+	unsigned char c[4];
+	int w, h, cw, ch;
+
+	c[0] = rnd() % 256;
+	c[1] = rnd() % 256;
+	c[2] = rnd() % 256;
+	c[3] = 255;
+
+	switch (kind) {
+	case KIND_GLYPHS:
+		c[0] = c[1] = c[2] = 0x33;
+		image_new(img, 24, 24);
+		draw_glyph(img, 0, 0, 24, 24, c);
+		break;
+
+	case KIND_MIXED:
+		/* mostly small sizes, a few big ones */
+		w = 8 + 120 * pow((rnd() % 1000) / 1000.0, 3);
+		h = rnd() % 4 == 0 ? w : 8 + 120 * pow((rnd() % 1000) / 1000.0, 3);
+		image_new(img, w, h);
+		if (rnd() % 3 == 0)
+			draw_photo(img);
+		draw_glyph(img, 0, 0, w, h, c);
+		break;
+
+	case KIND_PHOTOS:
+		image_new(img, rnd_range(48, 256), rnd_range(48, 256));
+		draw_photo(img);
+		break;
+
+	case KIND_PADDED:
+		w = rnd_range(64, 128);
+		h = rnd_range(64, 128);
+		cw = rnd_range(8, 32);
+		ch = rnd_range(8, 32);
+		image_new(img, w, h);
+		draw_glyph(img, rnd() % (w - cw), rnd() % (h - ch), cw, ch, c);
+		break;
+	}
+}
+
+void write_image(struct image *img, const char *name, int opaque)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_bytep row;
+	FILE *fp;
+	int x, y;
+
+	fp = fopen(name, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n", name, strerror(errno));
+		exit(1);
+	}
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_create_info_struct(png_ptr);
+	if (png_ptr == NULL || info_ptr == NULL || setjmp(png_jmpbuf(png_ptr))) {
+		fprintf(stderr, "cannot write file \"%s\"\n", name);
+		exit(1);
+	}
+	png_init_io(png_ptr, fp);
+	png_set_IHDR(png_ptr, info_ptr, img->width, img->height, 8,
+	             opaque ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
+	             PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info(png_ptr, info_ptr);
+
+	row = malloc((size_t)img->width * 4);
+	if (row == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (y=0; y<img->height; y++) {
+		if (opaque) {
+			for (x=0; x<img->width; x++)
+				memcpy(&row[x * 3], &img->pix[((size_t)y * img->width + x) * 4], 3);
+			png_write_row(png_ptr, row);
+		}
+		else
+			png_write_row(png_ptr, &img->pix[(size_t)y * img->width * 4]);
+	}
+	png_write_end(png_ptr, NULL);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	free(row);
+	fclose(fp);
+}
+
+void usage(void)
+{
+	fprintf(stderr,
+	"\n"
+	"mkcorpus kind count dir [seed]\n"
+	"\n"
+	"   kind   'glyphs' (24x24 icons of one color), 'mixed' (8 to 128 pixels,\n"
+	"          some opaque), 'photos' (opaque, 48 to 256 pixels) or 'padded'\n"
+	"          (8 to 32 pixels glyphs in 64 to 128 pixels transparent images)\n"
+	"   count  number of images\n"
+	"   dir    output directory, the names of the images are in dir/list\n"
+	"   seed   random seed, 1 by default\n"
+	"\n"
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	struct image img;
+	enum kind kind;
+	char name[4096];
+	char *error;
+	FILE *list;
+	long count;
+	long i;
+
+	if (argc < 4 || argc > 5) {
+		usage();
+		exit(1);
+	}
+
+	/**/ if (strcmp(argv[1], "glyphs") == 0)
+		kind = KIND_GLYPHS;
+	else if (strcmp(argv[1], "mixed") == 0)
+		kind = KIND_MIXED;
+	else if (strcmp(argv[1], "photos") == 0)
+		kind = KIND_PHOTOS;
+	else if (strcmp(argv[1], "padded") == 0)
+		kind = KIND_PADDED;
+	else {
+		fprintf(stderr, "unknown kind \"%s\"\n", argv[1]);
+		usage();
+		exit(1);
+	}
+
+	count = strtol(argv[2], &error, 10);
+	if (*error != '\0' || count < 1) {
+		fprintf(stderr, "count expect a number of images\n");
+		usage();
+		exit(1);
+	}
+
+	rnd_state = 1;
+	if (argc == 5)
+		rnd_state = strtoull(argv[4], NULL, 10);
+	rnd_state = rnd_state * 0x9e3779b97f4a7c15ULL + 1;
+
+	snprintf(name, sizeof(name), "%s/list", argv[3]);
+	list = fopen(name, "w");
+	if (list == NULL) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n", name, strerror(errno));
+		exit(1);
+	}
+
+	for (i=0; i<count; i++) {
+		make_image(&img, kind);
+		snprintf(name, sizeof(name), "%s/%06ld.png", argv[3], i);
+		write_image(&img, name, kind == KIND_PHOTOS);
+		fprintf(list, "%s\n", name);
+		free(img.pix);
+	}
+
+	if (fclose(list) != 0) {
+		fprintf(stderr, "cannot write file \"%s/list\": %s\n", argv[3], strerror(errno));
+		exit(1);
+	}
+	return 0;
+}
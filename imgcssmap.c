@@ -11,18 +11,36 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/inotify.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 #include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <time.h>
 #include <unistd.h>
 
 #include <png.h>
 #include <jpeglib.h>
+#include <zlib.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_AVX2_DISPATCH
+#endif
 
 char color_mask[6] = {
 	0xe0, /* 1 -> 3 bits */
@@ -36,6 +54,10 @@ char color_mask[6] = {
 struct general {
 	unsigned int hash;
 	const char *output;
+	int scale;          /* density of the output image */
+	int unit;           /* pixels of the input images by CSS pixel */
+	int width;          /* size of the output image in CSS pixels */
+	int height;
 };
 
 struct node {
@@ -47,24 +69,67 @@ struct node {
 	png_uint_32 dest_x;
 	png_uint_32 dest_y;
 
-	png_bytep *row_pointers;
+	/* position of the cropped image in the source image */
+	png_uint_32 crop_x;
+	png_uint_32 crop_y;
+
+	/* decoded images are stored in one block of rows of <stride>
+	 * bytes. <pixels> is the first pixel of the image, the crop only
+	 * moves it.
+	 */
+	png_bytep pixels;
+	size_t stride;
+
+	/* bounding box of the pixels with alpha, found by the decoder:
+	 * [bbox_x0, bbox_x1[ x [bbox_y0, bbox_y1[, empty if there are none.
+	 */
+	png_uint_32 bbox_x0;
+	png_uint_32 bbox_y0;
+	png_uint_32 bbox_x1;
+	png_uint_32 bbox_y1;
+
+	/* with the deduplication, images with the same pixels share the
+	 * place of the first one, which is <alias>.
+	 */
+	uint64_t fingerprint;
+	struct node *alias;
+
+	/* output image of the node, with the sheet limits */
+	int sheet;
 
 	char *name;
 	char *azname;
 };
 
+/* error reported by an image loader. The loaders may run in worker
+ * threads, so they cannot exit: the error is reported and handled by
+ * the main thread once all the images are loaded.
+ */
+struct imgerr {
+	int fatal;          /* the error stops the program */
+	char msg[256];
+};
+
 struct color {
 	unsigned char r;
 	unsigned char g;
 	unsigned char b;
 };
 
+/* placement surface. The pixels are stored as packed RGBA (in memory
+ * order r, g, b, a) and the occupancy is a separate bitmap with one bit
+ * per pixel. For each row we keep the number of free pixels and the
+ * position of the leftmost free pixel, these allow the first-fit scan
+ * to skip whole occupied spans.
+ */
 struct surface {
-	unsigned char used;
-	unsigned char r;
-	unsigned char g;
-	unsigned char b;
-	unsigned char a;
+	int width;
+	int height;
+	int words;        /* number of 64 bits words per occupancy row */
+	uint32_t *pixels;
+	uint64_t *used;
+	int *free;
+	int *lead;
 };
 
 enum template_elem_type {
@@ -79,31 +144,89 @@ enum template_elem_type {
 	ELEM_HASH,
 	ELEM_OUTPUT,
 	ELEM_ID,
+	ELEM_SHEET,
+	ELEM_SCALE,
+	ELEM_SHEETWIDTH,
+	ELEM_SHEETHEIGHT,
 };
 
-struct template_elem {
-	enum template_elem_type type;
-	char *string;
+/* a compiled template is a stream of opcodes: an ELEM_* byte, followed
+ * for ELEM_STRING by the length of the string (4 bytes) and the string.
+ * The stream ends with ELEM_END.
+ */
+#define ELEM_END 0xff
+
+/* output of a template, in memory */
+struct outbuf {
+	char *buf;
+	size_t len;
+	size_t size;
 };
 
 struct template {
 	struct template *next;
 
-	int nb[3];
-	struct template_elem *elems[3];
+	unsigned char *code[3];
+	int scaled;                /* uses $(scale) */
 
-	FILE *fh;
+	/* source files, for the watch mode */
+	const char *in_file;
+	const char *hdr_file;
+	const char *foot_file;
+
+	const char *out_file;
+};
+
+/* the templates are rendered by ranges of TPL_CHUNK images, each one in
+ * its own buffer. The files are written once all the buffers of the
+ * template are ready.
+ */
+#define TPL_CHUNK 1024
+
+struct tpl_render {
+	struct template **tpls;
+	int nb_tpl;
+	struct node **pool;
+	int nb_img;
+	struct general *gen;       /* one by sheet and by scale */
+	int nb_sheets;             /* sheets of one scale */
+	int nb_scales;
+	int threads;
+	int nb_chunks;             /* header, image ranges and footer */
+	struct outbuf *bufs;       /* nb_tpl * nb_scales * nb_chunks */
+	struct outbuf *mem;        /* the outputs are kept in memory */
+	pthread_t tid;
+	int async;
+};
+
+enum pack_algo {
+	PACK_FIRSTFIT,
+	PACK_SKYLINE,
+	PACK_MAXRECTS,
+};
+
+/* the template variables, "$(name)" in the templates */
+struct tpl_var {
+	const char *name;
+	enum template_elem_type type;
 };
 
-#define VAR_WIDTH   "$(width)"
-#define VAR_HEIGHT  "$(height)"
-#define VAR_OFFSETX "$(offsetx)"
-#define VAR_OFFSETY "$(offsety)"
-#define VAR_NAME    "$(name)"
-#define VAR_AZNAME  "$(azname)"
-#define VAR_HASH    "$(hash)"
-#define VAR_OUTPUT  "$(output)"
-#define VAR_ID      "$(id)"
+static const struct tpl_var tpl_vars[] = {
+	{ "width",   ELEM_WIDTH   },
+	{ "height",  ELEM_HEIGHT  },
+	{ "offsetx", ELEM_OFFSETX },
+	{ "offsety", ELEM_OFFSETY },
+	{ "name",    ELEM_NAME    },
+	{ "azname",  ELEM_AZNAME  },
+	{ "hash",    ELEM_HASH    },
+	{ "output",  ELEM_OUTPUT  },
+	{ "id",      ELEM_ID      },
+	{ "sheet",   ELEM_SHEET   },
+	{ "scale",   ELEM_SCALE   },
+	{ "sheetwidth",  ELEM_SHEETWIDTH  },
+	{ "sheetheight", ELEM_SHEETHEIGHT },
+	{ NULL }
+};
 
 void usage()
 {
@@ -111,7 +234,11 @@ void usage()
 	"\n"
 /*	 12345678901234567890123456789012345678901234567890123456789012345678901234567890 */
 	"imgcssmap [-t in_file out_file [-t in[:hdr:foot] out [...]]] [-q 1-6] [-i]\n"
-	"          [-na rrggbb] [-c] -o output_image input_file [...]\n"
+	"          [-na rrggbb] [-c] [-d] [-p algo] [-s] [-j N] [-O level]\n"
+	"          [-P colors] [--cache file] [--stable] [--watch]\n"
+	"          [--serve address] [--stats file] [--trace file]\n"
+	"          [--max-width N] [--max-height N] [--max-pixels N] [--scales list]\n"
+	"          -o output_image [-l file] input_file [...]\n"
 	"\n"
 	"   -t in[:hdr:foot] out  'in' containing the template (typically CSS) 'out'\n"
 	"                         file generated by the template. The optional 'hdr'\n"
@@ -124,8 +251,79 @@ void usage()
 	"                         rrggbb is hexadecimal representation of the color\n"
 	"   -i                    interlace png output image\n"
 	"   -c                    crop unused alpha space into input file\n"
+	"   -d                    images with the same pixels (after the crop) are\n"
+	"                         placed once, and share the same offsets\n"
+	"   -p algo               packing algorithm: 'firstfit' (default) scans the\n"
+	"                         whole free space, 'skyline' and 'maxrects' are\n"
+	"                         much faster on large sets of images\n"
+	"   -s                    streaming output: the output image rows are built\n"
+	"                         from the input images, the full canvas is never\n"
+	"                         allocated. The output image is the same.\n"
+	"   -j N                  use N threads. 0 uses one thread per CPU.\n"
+	"                         The images are loaded and the output image is\n"
+	"                         compressed in parallel (except with -i). The\n"
+	"                         templates are rendered by one of the threads\n"
+	"                         during the compression.\n"
+	"   -O level              search the smallest encoding of the output image\n"
+	"                         among png filters, zlib levels, strategies and\n"
+	"                         windows. 1 ranks a few candidates on a sample of\n"
+	"                         the rows, 2 fully encodes them, 3 tries all the\n"
+	"                         combinations. The size of each candidate is\n"
+	"                         reported. No effect with -i.\n"
+	"   -P colors             palette output image (PNG8) with at most 'colors'\n"
+	"                         entries (2-256), alpha included. Less colors give\n"
+	"                         a smaller image, with a lower fidelity.\n"
+	"                         Without -P, the smallest lossless format is used\n"
+	"                         (gray levels, palette, no alpha, 1 to 8 bits).\n"
+	"   --cache file          build cache. If the inputs, the templates and the\n"
+	"                         options did not change, the outputs are kept.\n"
+	"                         Otherwise the size of the unchanged inputs is\n"
+	"                         reused.\n"
+	"   --stable              stable layout: the images unchanged since the\n"
+	"                         previous build keep their place, the other ones\n"
+	"                         are placed in the free space. Needs --cache.\n"
+	"   --watch               after the build, watch the input images and the\n"
+	"                         templates and build again on each change. The\n"
+	"                         images stay in memory, only the changed files are\n"
+	"                         loaded again.\n"
+	"   --serve address       keep the outputs in memory and serve them over\n"
+	"                         HTTP, on a Unix socket if 'address' contains a\n"
+	"                         '/', otherwise on this port of 127.0.0.1. The\n"
+	"                         changed inputs are loaded again on request. The\n"
+	"                         ETag is the imgcssmap hash.\n"
+	"   --stats file          write the statistics of the build in JSON: wall\n"
+	"                         and CPU time of the phases, peak RSS, memory of\n"
+	"                         the images and of the canvas, size, fill ratio\n"
+	"                         and positions tested by the packer of the\n"
+	"                         layout, size of the outputs.\n"
+	"   --trace file          write the timeline of the build in the Chrome\n"
+	"                         trace format (chrome://tracing, Perfetto): the\n"
+	"                         phases, and for each thread the loading, crop,\n"
+	"                         placement and decoding of the images, the\n"
+	"                         compressed bands and the template chunks.\n"
+	"   --max-width N         sheet limits: the width, the height or the number\n"
+	"   --max-height N        of pixels of the output image. The images which\n"
+	"   --max-pixels N        do not fit go to more output images, the sheets,\n"
+	"                         named like output_image with '-1', '-2'... before\n"
+	"                         the extension. The sheets are encoded in\n"
+	"                         parallel. An image bigger than the limits is an\n"
+	"                         error. Not with --stable.\n"
+	"   --scales list         output images for several screen densities, like\n"
+	"                         '1,2,3'. The input images are at the biggest\n"
+	"                         scale. The layout is done once in CSS pixels (the\n"
+	"                         size of the images divided by the scale, rounded\n"
+	"                         up), the images of the other scales are reduced\n"
+	"                         in parallel with an area filter. The outputs are\n"
+	"                         named like output_image with '@2x', '@3x'...\n"
+	"                         before the extension. The templates which use\n"
+	"                         $(scale) are rendered for each scale, from the\n"
+	"                         smallest one, the other ones only for the\n"
+	"                         smallest scale. The sheet limits are the ones of\n"
+	"                         the biggest scale. Not with --stable.\n"
 	"   -o output_image       image builded. The name can contain 8 x 'X'. These\n"
 	"                         XXXXXXXX must be replaced by the imgcssmap hash.\n"
+	"   -l file               read the names of the input images from 'file',\n"
+	"                         one per line, after the ones of the command line.\n"
 	"\n"
 	"the template may contain this variables:\n"
 	"   $(width)   the image width\n"
@@ -135,73 +333,722 @@ void usage()
 	"   $(name)    the image name without extension\n"
 	"   $(azname)  the name only with this characters: 'a'-'z' '0'-'9' '_'\n"
 	"   $(id)      the index after sorting. first image is 0.\n"
+	"   $(sheet)   the output image of the image, first one is 0. $(output)\n"
+	"              and $(hash) are the name and the hash of this image.\n"
+	"   $(scale)   the scale of the output image, 1 without --scales.\n"
+	"   $(sheetwidth), $(sheetheight) the size of the output image in CSS\n"
+	"              pixels, for the background-size.\n"
+	"with --scales, the sizes and the offsets are in CSS pixels.\n"
 	"\n"
 	);
 }
 
+/*
+ * 64 bits hash of a buffer, the xxHash64 construction: 4 lanes of 64
+ * bits consume 32 bytes per round, then are merged. The words are read
+ * in little endian, so the hash does not depend on the host.
+ */
+#define XXH_P1 0x9e3779b185ebca87ULL
+#define XXH_P2 0xc2b2ae3d27d4eb4fULL
+#define XXH_P3 0x165667b19e3779f9ULL
+#define XXH_P4 0x85ebca77c2b2ae63ULL
+#define XXH_P5 0x27d4eb2f165667c5ULL
+
 static inline
-unsigned int hash(unsigned int in)
+uint64_t xxh_rotl(uint64_t v, int r)
 {
-  /* 4-byte integer hash, full avalanche
-   * http://burtleburtle.net/bob/hash/integer.html
-   */
-  in = (in+0x7ed55d16) + (in<<12);
-  in = (in^0xc761c23c) ^ (in>>19);
-  in = (in+0x165667b1) + (in<<5);
-  in = (in+0xd3a2646c) ^ (in<<9);
-  in = (in+0xfd7046c5) + (in<<3);
-  in = (in^0xb55a4f09) ^ (in>>16);
+	return (v << r) | (v >> (64 - r));
+}
 
-  return in;
+static inline
+uint64_t xxh_read64(const unsigned char *p)
+{
+	return (uint64_t)p[0]       | (uint64_t)p[1] << 8  |
+	       (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	       (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	       (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
 }
 
 static inline
-void image_memory(struct node *n)
+uint64_t xxh_read32(const unsigned char *p)
+{
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	       (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+}
+
+static inline
+uint64_t xxh_round(uint64_t acc, uint64_t in)
+{
+	acc += in * XXH_P2;
+	acc = xxh_rotl(acc, 31);
+	return acc * XXH_P1;
+}
+
+static inline
+uint64_t xxh_merge(uint64_t acc, uint64_t v)
+{
+	acc ^= xxh_round(0, v);
+	return acc * XXH_P1 + XXH_P4;
+}
+
+uint64_t xxh64(const void *data, size_t len, uint64_t seed)
+{
+	const unsigned char *p = data;
+	const unsigned char *end = p + len;
+	uint64_t v1, v2, v3, v4;
+	uint64_t h;
+
+	if (len >= 32) {
+		v1 = seed + XXH_P1 + XXH_P2;
+		v2 = seed + XXH_P2;
+		v3 = seed;
+		v4 = seed - XXH_P1;
+		do {
+			v1 = xxh_round(v1, xxh_read64(p));
+			v2 = xxh_round(v2, xxh_read64(p + 8));
+			v3 = xxh_round(v3, xxh_read64(p + 16));
+			v4 = xxh_round(v4, xxh_read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = xxh_rotl(v1, 1) + xxh_rotl(v2, 7) + xxh_rotl(v3, 12) + xxh_rotl(v4, 18);
+		h = xxh_merge(h, v1);
+		h = xxh_merge(h, v2);
+		h = xxh_merge(h, v3);
+		h = xxh_merge(h, v4);
+	}
+	else
+		h = seed + XXH_P5;
+	h += len;
+
+	/* the tail */
+	for (; p + 8 <= end; p += 8) {
+		h ^= xxh_round(0, xxh_read64(p));
+		h = xxh_rotl(h, 27) * XXH_P1 + XXH_P4;
+	}
+	if (p + 4 <= end) {
+		h ^= xxh_read32(p) * XXH_P1;
+		h = xxh_rotl(h, 23) * XXH_P2 + XXH_P3;
+		p += 4;
+	}
+	for (; p < end; p++) {
+		h ^= *p * XXH_P5;
+		h = xxh_rotl(h, 11) * XXH_P1;
+	}
+
+	/* avalanche */
+	h ^= h >> 33;
+	h *= XXH_P2;
+	h ^= h >> 29;
+	h *= XXH_P3;
+	h ^= h >> 32;
+	return h;
+}
+
+/*
+ * Statistics of the last build, written by --stats. The durations of
+ * the phases are in seconds. The CPU time is the one of the process, so
+ * it includes the worker threads. With several threads, the templates
+ * are rendered during the encoding, so their time is also counted in the
+ * encoding.
+ */
+enum phase {
+	PHASE_LOAD,         /* decode the images, and crop them */
+	PHASE_SORT,         /* deduplication and sort */
+	PHASE_PACK,
+	PHASE_DECODE,       /* images decoded into the canvas */
+	PHASE_SCALE,        /* images downscaled for the lower scales */
+	PHASE_HASH,
+	PHASE_TEMPLATES,
+	PHASE_ENCODE,
+	PHASE_MAX,
+};
+
+const char *phase_names[PHASE_MAX] = {
+	"load", "sort", "pack", "decode", "scale", "hash", "templates", "encode",
+};
+
+struct stats {
+	double wall[PHASE_MAX];
+	double cpu[PHASE_MAX];
+	int images;
+	int sheets;
+	int width;               /* of the widest sheet */
+	int height;              /* sum of the heights of the sheets */
+	long long area;          /* sum of the areas of the sheets */
+	int ymax;                /* height of the placement surfaces */
+	long long smin;          /* surface of the placed images */
+	long long probes;        /* positions tested by the packer */
+	long long probes_max;    /* most positions tested for one image */
+	long long canvas_bytes;
+	long long png_bytes;
+	long long tpl_bytes;
+};
+
+struct stats stats;
+
+/* start of a phase */
+struct stats_clock {
+	double wall;
+	double cpu;
+};
+
+static inline
+double stats_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static inline
+double stats_cpu(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* write the statistics in JSON */
+void stats_write(const char *path, long long image_bytes)
 {
+	struct rusage ru;
+	double area;
+	FILE *fh;
 	int i;
 
-	/* de la memoire pour charger l'image */
-	n->row_pointers = calloc(sizeof(png_bytep), n->height);
-	if (n->row_pointers == NULL) {
+	fh = fopen(path, "w");
+	if (fh == NULL) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n", path, strerror(errno));
+		return;
+	}
+
+	getrusage(RUSAGE_SELF, &ru);
+	area = stats.area;
+	fprintf(fh, "{\n");
+	fprintf(fh, "  \"phases\": {\n");
+	for (i=0; i<PHASE_MAX; i++)
+		fprintf(fh, "    \"%s\": { \"wall_ms\": %.3f, \"cpu_ms\": %.3f }%s\n",
+		        phase_names[i], stats.wall[i] * 1000, stats.cpu[i] * 1000,
+		        i < PHASE_MAX - 1 ? "," : "");
+	fprintf(fh, "  },\n");
+	fprintf(fh, "  \"memory\": {\n");
+	fprintf(fh, "    \"peak_rss_bytes\": %lld,\n", (long long)ru.ru_maxrss * 1024);
+	fprintf(fh, "    \"image_bytes\": %lld,\n", image_bytes);
+	fprintf(fh, "    \"canvas_bytes\": %lld\n", stats.canvas_bytes);
+	fprintf(fh, "  },\n");
+	fprintf(fh, "  \"layout\": {\n");
+	fprintf(fh, "    \"images\": %d,\n", stats.images);
+	fprintf(fh, "    \"sheets\": %d,\n", stats.sheets);
+	fprintf(fh, "    \"width\": %d,\n", stats.width);
+	fprintf(fh, "    \"ymax\": %d,\n", stats.ymax);
+	fprintf(fh, "    \"height\": %d,\n", stats.height);
+	fprintf(fh, "    \"smin\": %lld,\n", stats.smin);
+	fprintf(fh, "    \"fill\": %.6f,\n", area > 0 ? stats.smin / area : 0);
+	fprintf(fh, "    \"wasted\": %.0f,\n", area - stats.smin);
+	fprintf(fh, "    \"probes\": %lld,\n", stats.probes);
+	fprintf(fh, "    \"probes_per_image\": %.3f,\n",
+	        stats.images ? (double)stats.probes / stats.images : 0);
+	fprintf(fh, "    \"probes_max\": %lld\n", stats.probes_max);
+	fprintf(fh, "  },\n");
+	fprintf(fh, "  \"output\": {\n");
+	fprintf(fh, "    \"png_bytes\": %lld,\n", stats.png_bytes);
+	fprintf(fh, "    \"template_bytes\": %lld\n", stats.tpl_bytes);
+	fprintf(fh, "  }\n");
+	fprintf(fh, "}\n");
+
+	if (fclose(fh) != 0)
+		fprintf(stderr, "cannot write file \"%s\": %s\n", path, strerror(errno));
+}
+
+/*
+ * Timeline of the build, written by --trace in the Chrome trace event
+ * format. The spans are recorded by all the threads into one array, each
+ * one with the file it works on and two numbers (usually the size).
+ */
+struct trace_event {
+	const char *name;
+	const char *file;
+	const char *k1;
+	const char *k2;
+	long v1;
+	long v2;
+	double ts;
+	double dur;
+	int tid;
+};
+
+struct trace {
+	pthread_mutex_t lock;
+	int on;
+	double start;
+	int nb_threads;
+	int nb;
+	int size;
+	struct trace_event *events;
+};
+
+struct trace trace = { PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, 0, NULL };
+
+/* small thread number, 1 is the first thread which records a span */
+__thread int trace_tid;
+
+/* record the span <name> started at <start> (from stats_now()). The
+ * strings must stay valid until the trace is written.
+ */
+void trace_span(const char *name, double start, const char *file,
+                const char *k1, long v1, const char *k2, long v2)
+{
+	struct trace_event *ev;
+	double end;
+
+	if (!trace.on)
+		return;
+	end = stats_now();
+
+	pthread_mutex_lock(&trace.lock);
+	if (trace_tid == 0)
+		trace_tid = ++trace.nb_threads;
+	if (trace.nb == trace.size) {
+		trace.size = trace.size ? trace.size * 2 : 1024;
+		trace.events = realloc(trace.events, sizeof(struct trace_event) * trace.size);
+		if (trace.events == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	ev = &trace.events[trace.nb++];
+	ev->name = name;
+	ev->file = file;
+	ev->k1 = k1;
+	ev->v1 = v1;
+	ev->k2 = k2;
+	ev->v2 = v2;
+	ev->ts = (start - trace.start) * 1e6;
+	ev->dur = (end - start) * 1e6;
+	ev->tid = trace_tid;
+	pthread_mutex_unlock(&trace.lock);
+}
+
+static
+void trace_string(FILE *fh, const char *str)
+{
+	fputc('"', fh);
+	for (; *str != '\0'; str++) {
+		if (*str == '"' || *str == '\\')
+			fprintf(fh, "\\%c", *str);
+		else if ((unsigned char)*str < 0x20)
+			fprintf(fh, "\\u%04x", *str);
+		else
+			fputc(*str, fh);
+	}
+	fputc('"', fh);
+}
+
+/* write the recorded spans, and forget them */
+void trace_write(const char *path)
+{
+	struct trace_event *ev;
+	FILE *fh;
+	int i;
+
+	fh = fopen(path, "w");
+	if (fh == NULL) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n", path, strerror(errno));
+		return;
+	}
+
+	pthread_mutex_lock(&trace.lock);
+	fprintf(fh, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+	fprintf(fh, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":1,"
+	            "\"args\":{\"name\":\"main\"}}");
+	for (i=0; i<trace.nb; i++) {
+		ev = &trace.events[i];
+		fprintf(fh, ",\n{\"name\":\"%s\",\"cat\":\"imgcssmap\",\"ph\":\"X\","
+		            "\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d,\"args\":{",
+		        ev->name, ev->ts, ev->dur, ev->tid);
+		if (ev->file != NULL) {
+			fprintf(fh, "\"file\":");
+			trace_string(fh, ev->file);
+		}
+		if (ev->k1 != NULL)
+			fprintf(fh, "%s\"%s\":%ld", ev->file ? "," : "", ev->k1, ev->v1);
+		if (ev->k2 != NULL)
+			fprintf(fh, ",\"%s\":%ld", ev->k2, ev->v2);
+		fprintf(fh, "}}");
+	}
+	fprintf(fh, "\n]}\n");
+	trace.nb = 0;
+	pthread_mutex_unlock(&trace.lock);
+
+	if (fclose(fh) != 0)
+		fprintf(stderr, "cannot write file \"%s\": %s\n", path, strerror(errno));
+}
+
+/* the phases are timed for --stats, and are spans of the trace */
+static inline
+void stats_start(struct stats_clock *c)
+{
+	c->wall = stats_now();
+	c->cpu = stats_cpu();
+}
+
+static inline
+void stats_end(struct stats_clock *c, enum phase ph)
+{
+	stats.wall[ph] = stats_now() - c->wall;
+	stats.cpu[ph] = stats_cpu() - c->cpu;
+	trace_span(phase_names[ph], c->wall, NULL, NULL, 0, NULL, 0);
+}
+
+static
+void imgerr_set(struct imgerr *err, int fatal, const char *fmt, ...)
+{
+	va_list ap;
+
+	err->fatal = fatal;
+	va_start(ap, fmt);
+	vsnprintf(err->msg, sizeof(err->msg), fmt, ap);
+	va_end(ap);
+}
+
+/*
+ * Work stealing pool. The tasks are numbered from 0 to nb_tasks - 1, and
+ * each worker owns a contiguous range of them. A worker takes its tasks
+ * from the start of its range, and when its range is empty it steals
+ * tasks from the end of the ranges of the other workers. No task is
+ * added while the pool runs, so a worker stops when all the ranges are
+ * empty. The calling thread is the worker 0.
+ */
+struct workpool;
+
+struct worker {
+	pthread_t tid;
+	pthread_mutex_t lock;
+	int lo;
+	int hi;
+	int id;
+	struct workpool *pool;
+};
+
+struct workpool {
+	int nb;
+	struct worker *workers;
+	void (*func)(void *arg, int task);
+	void *arg;
+};
+
+static
+int worker_next(struct worker *w)
+{
+	int task = -1;
+
+	pthread_mutex_lock(&w->lock);
+	if (w->lo < w->hi)
+		task = w->lo++;
+	pthread_mutex_unlock(&w->lock);
+	return task;
+}
+
+static
+int worker_steal(struct worker *w)
+{
+	struct workpool *pool = w->pool;
+	struct worker *victim;
+	int task = -1;
+	int i;
+
+	for (i=1; i<pool->nb && task < 0; i++) {
+		victim = &pool->workers[(w->id + i) % pool->nb];
+		pthread_mutex_lock(&victim->lock);
+		if (victim->lo < victim->hi)
+			task = --victim->hi;
+		pthread_mutex_unlock(&victim->lock);
+	}
+	return task;
+}
+
+static
+void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+	int task;
+
+	while (1) {
+		task = worker_next(w);
+		if (task < 0)
+			task = worker_steal(w);
+		if (task < 0)
+			break;
+		w->pool->func(w->pool->arg, task);
+	}
+	return NULL;
+}
+
+/* run func(arg, task) for each task from 0 to <nb_tasks> - 1 on
+ * <nb_threads> threads, and return when all the tasks are done.
+ */
+void workpool_run(int nb_threads, int nb_tasks, void (*func)(void *arg, int task), void *arg)
+{
+	struct workpool pool;
+	int i;
+
+	if (nb_threads > nb_tasks)
+		nb_threads = nb_tasks;
+
+	/* no threads needed */
+	if (nb_threads <= 1) {
+		for (i=0; i<nb_tasks; i++)
+			func(arg, i);
+		return;
+	}
+
+	pool.nb = nb_threads;
+	pool.func = func;
+	pool.arg = arg;
+	pool.workers = calloc(sizeof(struct worker), nb_threads);
+	if (pool.workers == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(1);
 	}
-	for (i=0; i<n->height; i++) {
-		n->row_pointers[i] = calloc(n->width, 4);
-		if (n->row_pointers[i] == NULL) {
+
+	for (i=0; i<nb_threads; i++) {
+		pool.workers[i].id = i;
+		pool.workers[i].pool = &pool;
+		pool.workers[i].lo = (long long)nb_tasks * i / nb_threads;
+		pool.workers[i].hi = (long long)nb_tasks * (i + 1) / nb_threads;
+		pthread_mutex_init(&pool.workers[i].lock, NULL);
+	}
+
+	for (i=1; i<nb_threads; i++) {
+		if (pthread_create(&pool.workers[i].tid, NULL, worker_main, &pool.workers[i]) != 0) {
+			fprintf(stderr, "cannot create thread: %s\n", strerror(errno));
+			exit(1);
+		}
+	}
+	worker_main(&pool.workers[0]);
+	for (i=1; i<nb_threads; i++)
+		pthread_join(pool.workers[i].tid, NULL);
+
+	for (i=0; i<nb_threads; i++)
+		pthread_mutex_destroy(&pool.workers[i].lock);
+	free(pool.workers);
+}
+
+/*
+ * Bump allocator. The memory is carved from big zeroed chunks, and is
+ * never freed one allocation at a time: all the chunks are released at
+ * once. Allocations can be done from several threads.
+ */
+#define ARENA_CHUNK (4 * 1024 * 1024)
+#define ARENA_ALIGN 16
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(ARENA_ALIGN)));
+};
+
+struct arena {
+	pthread_mutex_t lock;
+	struct arena_chunk *chunks;
+	size_t total;
+	size_t used;              /* allocated bytes */
+};
+
+/* the decoded images */
+struct arena img_arena = { PTHREAD_MUTEX_INITIALIZER, NULL, 0, 0 };
+
+void *arena_alloc(struct arena *a, size_t size)
+{
+	struct arena_chunk *c;
+	size_t csize;
+	void *p;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+	pthread_mutex_lock(&a->lock);
+	c = a->chunks;
+	if (c == NULL || c->size - c->used < size) {
+
+		/* big allocations get their own chunk, which is inserted
+		 * after the current one, so this one is still used for the
+		 * next allocations.
+		 */
+		csize = size > ARENA_CHUNK ? size : ARENA_CHUNK;
+		c = calloc(1, sizeof(struct arena_chunk) + csize);
+		if (c == NULL) {
 			fprintf(stderr, "out of memory\n");
 			exit(1);
 		}
+		c->size = csize;
+		a->total += csize;
+		if (size < ARENA_CHUNK || a->chunks == NULL) {
+			c->next = a->chunks;
+			a->chunks = c;
+		}
+		else {
+			c->next = a->chunks->next;
+			a->chunks->next = c;
+		}
+	}
+	p = c->data + c->used;
+	c->used += size;
+	a->used += size;
+	pthread_mutex_unlock(&a->lock);
+
+	return p;
+}
+
+void arena_release(struct arena *a)
+{
+	struct arena_chunk *c;
+
+	pthread_mutex_lock(&a->lock);
+	while (a->chunks != NULL) {
+		c = a->chunks;
+		a->chunks = c->next;
+		free(c);
+	}
+	a->total = 0;
+	a->used = 0;
+	pthread_mutex_unlock(&a->lock);
+}
+
+/* memory for a decoded image: the pixels are one zeroed block taken
+ * from the images arena.
+ */
+static inline
+void image_memory(struct node *n)
+{
+	n->stride = (size_t)n->width * 4;
+	n->pixels = arena_alloc(&img_arena, n->stride * n->height);
+}
+
+/* the row <y> of a decoded image */
+static inline
+png_bytep node_row(struct node *n, int y)
+{
+	return n->pixels + n->stride * y;
+}
+
+/* first and last pixels of the row with alpha > 0. The alpha bytes are
+ * tested two pixels at a time with a 64 bits mask. Returns 0 if all the
+ * row is transparent.
+ */
+static inline
+int row_alpha_span(const unsigned char *row, int width, int *first, int *last)
+{
+	static const unsigned char alpha_bytes[8] = { 0, 0, 0, 0xff, 0, 0, 0, 0xff };
+	uint64_t mask;
+	uint64_t w;
+	int x;
+
+	memcpy(&mask, alpha_bytes, 8);
+
+	/* from the left */
+	for (x=0; x+2<=width; x+=2) {
+		memcpy(&w, row + x * 4, 8);
+		if (w & mask)
+			break;
+	}
+	if (x+2 > width && (x >= width || row[x * 4 + 3] == 0))
+		return 0;
+	*first = row[x * 4 + 3] != 0 ? x : x + 1;
+
+	/* from the right, it stops at least on the first one */
+	for (x=width-2; x>=0; x-=2) {
+		memcpy(&w, row + x * 4, 8);
+		if (w & mask)
+			break;
+	}
+	if (x < 0)
+		x = 0;
+	else if (row[x * 4 + 7] != 0) {
+		*last = x + 1;
+		return 1;
 	}
+	*last = x;
+	return 1;
+}
+
+/* update the bounding box of <n> with its row <y> */
+static inline
+void bbox_row(struct node *n, int y, const unsigned char *row)
+{
+	int first;
+	int last;
+
+	if (!row_alpha_span(row, n->width, &first, &last))
+		return;
+	if (y < n->bbox_y0)
+		n->bbox_y0 = y;
+	n->bbox_y1 = y + 1;
+	if (first < n->bbox_x0)
+		n->bbox_x0 = first;
+	if (last + 1 > n->bbox_x1)
+		n->bbox_x1 = last + 1;
+}
+
+enum read_mode {
+	READ_PROBE,     /* only read the image size */
+	READ_ALLOC,     /* decode into memory allocated for the image */
+	READ_INTO,      /* decode into the rows given by the caller */
+};
+
+/* libjpeg error manager: the standard one exits, this one reports the
+ * error and jumps back to the decoder of this image.
+ */
+struct jpg_error {
+	struct jpeg_error_mgr pub;
+	jmp_buf jmp;
+	struct imgerr *err;
+	const char *name;
+};
+
+static
+void jpg_error_exit(j_common_ptr cinfo)
+{
+	struct jpg_error *jerr = (struct jpg_error *)cinfo->err;
+	char buffer[JMSG_LENGTH_MAX];
+
+	(*cinfo->err->format_message)(cinfo, buffer);
+	imgerr_set(jerr->err, 1, "jpeg read \"%s\" error: %s\n", jerr->name, buffer);
+	longjmp(jerr->jmp, 1);
 }
 
-struct node *openjpg(const char *filename)
+int openjpg(struct node *n, const char *filename, enum read_mode mode,
+            png_bytep *rows, struct imgerr *err)
 {
 	struct jpeg_decompress_struct cinfo;
-	struct jpeg_error_mgr jerr;
+	struct jpg_error jerr;
+	JSAMPARRAY buffer;
 	JSAMPROW row_pointer;
+	png_bytep out;
 	FILE *infile;
 	unsigned long location = 0;
 	int i = 0;
 	int x;
-	struct node *n;
 
 	infile = fopen(filename, "r");
 	if (infile == NULL) {
-		fprintf(stderr, "Error opening jpeg file %s\n!", filename);
-		return NULL;
+		imgerr_set(err, 0, "Error opening jpeg file %s\n!", filename);
+		return -1;
 	}
 
-	/* on fabrique le noeud qui va contenir l'image */
-	n = malloc(sizeof(struct node));
-	if (n == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(1);
+	/* here we set up our own error handler, based on the standard one */
+	cinfo.err = jpeg_std_error(&jerr.pub);
+	jerr.pub.error_exit = jpg_error_exit;
+	jerr.err = err;
+	jerr.name = filename;
+	if (setjmp(jerr.jmp)) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(infile);
+		return -1;
 	}
 
-	/* here we set up the standard libjpeg error handler */
-	cinfo.err = jpeg_std_error(&jerr);
-
 	/* setup decompression process and source, then read JPEG header */
 	jpeg_create_decompress(&cinfo);
 
@@ -220,32 +1067,46 @@ struct node *openjpg(const char *filename)
 	n->width = cinfo.image_width;
 	n->height = cinfo.image_height;
 	n->surface = n->width * n->height;
+
+	/* only the size is required */
+	if (mode == READ_PROBE) {
+		jpeg_destroy_decompress(&cinfo);
+		fclose(infile);
+		return 0;
+	}
  
 	/* Start decompression jpeg here */
 	jpeg_start_decompress(&cinfo);
 
 	/* allocate memory to hold the uncompressed image */
-	image_memory(n);
+	if (mode == READ_ALLOC)
+		image_memory(n);
 
-	/* now actually read the jpeg into the raw buffer */
-	row_pointer = malloc(cinfo.output_width * cinfo.num_components);
+	/* now actually read the jpeg into the raw buffer. The line buffer
+	 * is allocated by libjpeg, so it is released with the decompressor
+	 * even if an error occurs.
+	 */
+	buffer = (*cinfo.mem->alloc_sarray)((j_common_ptr)&cinfo, JPOOL_IMAGE,
+	                                    cinfo.output_width * cinfo.num_components, 1);
+	row_pointer = buffer[0];
 
 	/* read one scan line at a time */
 	location = 0;
 	while (cinfo.output_scanline < cinfo.image_height) {
 
 		/* read one line */
-		jpeg_read_scanlines(&cinfo, &row_pointer, 1);
+		jpeg_read_scanlines(&cinfo, buffer, 1);
+		out = mode == READ_INTO ? rows[location] : node_row(n, location);
 
 		/* copy RGB line */
 		if (cinfo.jpeg_color_space == JCS_RGB || 
 		    cinfo.jpeg_color_space == JCS_YCbCr) {
 			x = 0;
 			for (i=0; i<n->width*3; i+=3) {
-				n->row_pointers[location][x+0] = row_pointer[i+0];
-				n->row_pointers[location][x+1] = row_pointer[i+1];
-				n->row_pointers[location][x+2] = row_pointer[i+2];
-				n->row_pointers[location][x+3] = 0xff;
+				out[x+0] = row_pointer[i+0];
+				out[x+1] = row_pointer[i+1];
+				out[x+2] = row_pointer[i+2];
+				out[x+3] = 0xff;
 				x += 4;
 			}
 		}
@@ -270,10 +1131,10 @@ struct node *openjpg(const char *filename)
 				g = ( 1.164 * (y - 16) ) - ( 0.813 * (v - 128) ) - ( 0.391* (u - 128) );
 				b = ( 1.164 * (y - 16) ) + ( 2.018 * (u - 128) );
 
-				n->row_pointers[location][x+0] = r;
-				n->row_pointers[location][x+1] = g;
-				n->row_pointers[location][x+2] = b;
-				n->row_pointers[location][x+3] = 0xff;
+				out[x+0] = r;
+				out[x+1] = g;
+				out[x+2] = b;
+				out[x+3] = 0xff;
 
 				x += 4;
 			}
@@ -284,10 +1145,10 @@ struct node *openjpg(const char *filename)
 		if (cinfo.jpeg_color_space == JCS_GRAYSCALE) {	
 			x = 0;
 			for (i=0; i<n->width; i++) {
-				n->row_pointers[location][x+0] = row_pointer[i+0];
-				n->row_pointers[location][x+1] = row_pointer[i+0];
-				n->row_pointers[location][x+2] = row_pointer[i+0];
-				n->row_pointers[location][x+3] = 0xff;
+				out[x+0] = row_pointer[i+0];
+				out[x+1] = row_pointer[i+0];
+				out[x+2] = row_pointer[i+0];
+				out[x+3] = 0xff;
 				x += 4;
 			}
 		}
@@ -299,47 +1160,62 @@ struct node *openjpg(const char *filename)
 	/* wrap up decompression, destroy objects, free pointers and close open files */
 	jpeg_finish_decompress(&cinfo);
 	jpeg_destroy_decompress(&cinfo);
-	free(row_pointer);
 	fclose(infile);
 
+	/* jpeg images are opaque */
+	n->bbox_x0 = 0;
+	n->bbox_y0 = 0;
+	n->bbox_x1 = n->width;
+	n->bbox_y1 = n->height;
+
 	/* yup, we succeeded! */
-	return n;
+	return 0;
+}
+
+/* libpng error handler: keep the message for the error report, and
+ * jump back to the decoder of this image.
+ */
+static
+void png_error_fn(png_structp png_ptr, png_const_charp msg)
+{
+	struct imgerr *err = png_get_error_ptr(png_ptr);
+
+	snprintf(err->msg, sizeof(err->msg), "%s", msg);
+	longjmp(png_jmpbuf(png_ptr), 1);
 }
 
-struct node *openpng(const char *name)
+int openpng(struct node *n, const char *name, enum read_mode mode,
+            png_bytep *rows, struct imgerr *err)
 {
+	char msg[sizeof(err->msg)];
 	unsigned char sig[8];
-	struct node *n;
 	FILE *fh;
 	png_structp png_ptr;
 	png_infop info_ptr;
 	int bit_depth;
 	int color_type;
+	png_bytep row;
+	int passes;
+	int pass;
+	int y;
 
 	/* ouverture du fichier */
 	fh = fopen(name, "r");
 	if (fh == NULL) {
-		fprintf(stderr, "cannot open file \"%s\": %s\n",
-		        name, strerror(errno));
-		exit(1);
+		imgerr_set(err, 1, "cannot open file \"%s\": %s\n",
+		           name, strerror(errno));
+		return -1;
 	}
 
 	/* on verifie la signature */
-	fread(sig, 1, 8, fh);
-	if (!png_check_sig(sig, 8)) {
-		fprintf(stderr, "bad png signature \"%s\"\n", name);
-		exit(1);
-	}
-
-	/* on fabrique le noeud qui va contenir l'image */
-	n = malloc(sizeof(struct node));
-	if (n == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(1);
+	if (fread(sig, 1, 8, fh) != 8 || !png_check_sig(sig, 8)) {
+		imgerr_set(err, 1, "bad png signature \"%s\"\n", name);
+		fclose(fh);
+		return -1;
 	}
 
 	/* on fabrique la structure qui va recevoir l'image */
-	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, err, png_error_fn, NULL);
 	if (!png_ptr) {
 		fprintf(stderr, "out of memory\n");
 		exit(1);
@@ -353,9 +1229,12 @@ struct node *openpng(const char *name)
 	}
 
 	/* traitement des erreurs */
-	if (setjmp(png_ptr->jmpbuf)) {
-		fprintf(stderr, "png read \"%s\" error\n", name);
-		exit(1);
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		strcpy(msg, err->msg);
+		imgerr_set(err, 1, "png read \"%s\" error: %s\n", name, msg);
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(fh);
+		return -1;
 	}
 
 	/* positionne le handler du fichier qui sera utilis pour la lecture */
@@ -371,13 +1250,23 @@ struct node *openpng(const char *name)
 	png_get_IHDR(png_ptr, info_ptr,
 	             &n->width, &n->height, &bit_depth, &color_type,
 	             NULL, NULL, NULL);
+
+	/* calcule la surface de l'image */
+	n->surface = n->width * n->height;
+
+	/* only the size is required */
+	if (mode == READ_PROBE) {
+		png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+		fclose(fh);
+		return 0;
+	}
 	
 	/* on convertit le "gray" en RGB */
 	if ((color_type & PNG_COLOR_MASK_COLOR) == 0) {
 
 		/* transform grayscale of less than 8 to 8 bits */
 		if (bit_depth < 8)
-			png_set_gray_1_2_4_to_8(png_ptr);
+			png_set_expand_gray_1_2_4_to_8(png_ptr);
 
 		png_set_gray_to_rgb(png_ptr);
 	}
@@ -400,697 +1289,5252 @@ struct node *openpng(const char *name)
 	/* adds a full alpha channel if there is transparency information in a tRNS chunk */
 	if (png_get_valid(png_ptr, info_ptr, PNG_INFO_tRNS))
 		png_set_tRNS_to_alpha(png_ptr);
-	
-	/* calcule la surface de l'image */
-	n->surface = n->width * n->height;
 
 	/* de la memoire pour charger l'image */
-	image_memory(n);
+	if (mode == READ_ALLOC)
+		image_memory(n);
 
-	/* load image */
-	png_read_image(png_ptr, n->row_pointers);
+	/* load image, one row at a time. The bounding box of the pixels
+	 * with alpha is computed when the row is complete, while it is
+	 * still in the cache.
+	 */
+	passes = png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+	n->bbox_x0 = n->width;
+	n->bbox_y0 = n->height;
+	n->bbox_x1 = 0;
+	n->bbox_y1 = 0;
+	for (pass=0; pass<passes; pass++) {
+		for (y=0; y<n->height; y++) {
+			row = mode == READ_INTO ? rows[y] : node_row(n, y);
+			png_read_row(png_ptr, row, NULL);
+			if (pass == passes - 1 && mode == READ_ALLOC)
+				bbox_row(n, y, row);
+		}
+	}
 
 	fclose(fh);
 	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
 
-	return n;
+	return 0;
 }
 
-struct node *openimage(const char *name)
+enum img_type {
+	IMG_NONE,
+	IMG_JPG,
+	IMG_PNG,
+	IMG_UNKNOWN,
+};
+
+enum img_type image_type(const char *name)
 {
 	const char *ext;
 
 	/* get extension */
 	ext = strrchr(name, '.');
 	if (ext == NULL)
-		return NULL;
+		return IMG_NONE;
 	
 	ext++;
 
 	/* jpeg file */
 	/**/ if (strcasecmp(ext, "jpg") == 0 ||
 	         strcasecmp(ext, "jpeg") == 0)
-		return openjpg(name);
+		return IMG_JPG;
 
 	/* png file */
 	else if (strcasecmp(ext, "png") == 0)
-		return openpng(name);
-	
-	fprintf(stderr, "unmanaged file format \"%s\"\n", name);
-	exit(1);
+		return IMG_PNG;
+
+	return IMG_UNKNOWN;
 }
 
-void crop(struct node *n)
+/* open the image <name>. With READ_PROBE only the size is read, with
+ * READ_ALLOC the image is decoded into its own memory.
+ */
+struct node *openimage(const char *name, enum read_mode mode, struct imgerr *err)
 {
-	int x;
-	int y;
-	int yp;
-	int do_crop;
-	int rem;
+	enum img_type type;
+	struct node *n;
+	double start;
+	int ret;
 
-	/*
-	 *
-	 * remove unused top ligne
-	 *
-	 */
-	rem = 0;
-	for (y=0; y<n->height; y++) {
-		do_crop = 1;
-		for (x=0; x<n->width; x++) {
-			if (n->row_pointers[y][(x*4)+3] > 0x00) {
-				do_crop = 0;
-				break;
-			}
-		}
-		if (do_crop)
-			rem++;
-		else
-			break;
-	}
-	yp = 0;
-	for (y=rem; y<n->height; y++) {
-		n->row_pointers[yp] = n->row_pointers[y];
-		yp++;
+	start = stats_now();
+	type = image_type(name);
+	if (type == IMG_NONE)
+		return NULL;
+	if (type == IMG_UNKNOWN) {
+		imgerr_set(err, 1, "unmanaged file format \"%s\"\n", name);
+		return NULL;
 	}
-	n->height -= rem;
 
-	/*
-	 *
-	 * remove unused bottom lines
-	 *
-	 */
-	rem = 0;
-	for (y=n->height-1; y>=0; y--) {
-		do_crop = 1;
-		for (x=0; x<n->width; x++) {
-			if (n->row_pointers[y][(x*4)+3] > 0x00) {
-				do_crop = 0;
-				break;
-			}
-		}
-		if (do_crop)
-			rem++;
-		else
-			break;
+	/* on fabrique le noeud qui va contenir l'image */
+	n = calloc(sizeof(struct node), 1);
+	if (n == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
 	}
-	n->height -= rem;
 
-	/*
-	 *
-	 * remove unused left columns 
-	 *
-	 */
-	rem = 0;
-	for (x=0; x<n->width; x++) {
-		do_crop = 1;
-		for(y=0; y<n->height; y++) {
-			if (n->row_pointers[y][(x*4)+3] > 0x00) {
-				do_crop = 0;
-				break;
-			}
-		}
-		if (do_crop)
-			rem++;
-		else
-			break;
-	}
-	for(y=0; y<n->height; y++)
-		n->row_pointers[y] = n->row_pointers[y] + ( rem * 4 );
-	n->width -= rem;
+	if (type == IMG_JPG)
+		ret = openjpg(n, name, mode, NULL, err);
+	else
+		ret = openpng(n, name, mode, NULL, err);
 
-	/*
-	 *
-	 * remove unused right columns
-	 *
-	 */
-	rem = 0;
-	for (x=n->width-1; x>=0; x++) {
-		do_crop = 1;
-		for(y=0; y<n->height; y++) {
-			if (n->row_pointers[y][(x*4)+3] > 0x00) {
-				do_crop = 0;
-				break;
-			}
-		}
-		if (do_crop)
-			rem++;
-		else
-			break;
+	/* the image memory stays in the arena */
+	if (ret < 0) {
+		free(n);
+		return NULL;
 	}
-	n->width -= rem;
+	trace_span("openimage", start, name, "width", n->width, "height", n->height);
+	return n;
+}
+
+/* decode the image of the node <n> into the rows <rows>. The node size
+ * was read by openimage() with READ_PROBE.
+ */
+int decodeimage(struct node *n, png_bytep *rows, struct imgerr *err)
+{
+	double start;
+	int ret;
+
+	start = stats_now();
+	if (image_type(n->name) == IMG_JPG)
+		ret = openjpg(n, n->name, READ_INTO, rows, err);
+	else
+		ret = openpng(n, n->name, READ_INTO, rows, err);
+	trace_span("decode", start, n->name, "width", n->width, "height", n->height);
+	return ret;
+}
 
-	/* update surface */
+/* crop the image with known bounds. Only the first pixel of the image
+ * moves, the rows stay in place.
+ */
+void crop_apply(struct node *n, int x, int y, int width, int height)
+{
+	n->pixels += n->stride * y + x * 4;
+	n->crop_x = x;
+	n->crop_y = y;
+	n->width = width;
+	n->height = height;
 	n->surface = n->height * n->width;
 }
 
-#define appli_alpha(__c, __b, __a) \
-	( ( (__c * __a) + ( (__b * (255 - __a) ) ) ) / 255)
+/* remove the unused alpha space around the image, using the bounding box
+ * found by the decoder.
+ */
+void crop(struct node *n)
+{
+	if (n->bbox_x0 >= n->bbox_x1 || n->bbox_y0 >= n->bbox_y1)
+		crop_apply(n, 0, 0, 0, 0);
+	else
+		crop_apply(n, n->bbox_x0, n->bbox_y0,
+		           n->bbox_x1 - n->bbox_x0, n->bbox_y1 - n->bbox_y0);
+}
 
-void drawpng(struct surface *buffer, int width, int height, int qual, int interlace,
-             struct color *alpha, const char *name)
+/* allocate the surface. The pixel canvas is not allocated if <pixels>
+ * is 0 (streaming output), and the occupancy bitmap is not allocated if
+ * <used> is 0 (the packer keeps its own free space description).
+ */
+void surface_init(struct surface *surf, int width, int height, int pixels, int used)
 {
-	FILE *fp;
-	png_structp png_ptr;
-	png_infop info_ptr;
-	png_bytep row;
-	int basex;
-	int basey;
-	int x;
 	int y;
-	int passes;
-	int n;
 
-	/* Open file for writing (binary mode) */
-	fp = fopen(name, "wb");
-	if (fp == NULL) {
-		fprintf(stderr, "Could not open file %s for writing\n", name);
-		exit(1);
-	}
-
-	/* Initialize write structure */
-	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-	if (png_ptr == NULL) {
-		fprintf(stderr, "Could not allocate write struct\n");
-		exit(1);
-	}
+	memset(surf, 0, sizeof(*surf));
+	surf->width = width;
+	surf->height = height;
+	surf->words = (width + 63) / 64;
 
-	/* Initialize info structure */
-	info_ptr = png_create_info_struct(png_ptr);
-	if (info_ptr == NULL) {
-		fprintf(stderr, "Could not allocate info struct\n");
-		exit(1);
+	if (pixels) {
+		surf->pixels = calloc(sizeof(uint32_t), (size_t)width * height);
+		if (surf->pixels == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
 	}
 
-	/* Setup Exception handling */
-	if (setjmp(png_jmpbuf(png_ptr))) {
-		fprintf(stderr, "Error during png creation\n");
-		exit(1);
+	if (used) {
+		surf->used = calloc(sizeof(uint64_t), (size_t)surf->words * height);
+		surf->free = malloc(sizeof(int) * height);
+		surf->lead = calloc(sizeof(int), height);
+		if (surf->used == NULL || surf->free == NULL || surf->lead == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		for (y=0; y<height; y++)
+			surf->free[y] = width;
 	}
+}
 
-	png_init_io(png_ptr, fp);
-
-	/* Write header (8 bit colour depth + alpha) */
-	png_set_IHDR(png_ptr, info_ptr, width, height,
-	             8,
-	             alpha ? PNG_COLOR_TYPE_RGB : PNG_COLOR_TYPE_RGB_ALPHA,
-	             interlace ?  PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, 
-	             PNG_COMPRESSION_TYPE_BASE,
-	             PNG_FILTER_TYPE_BASE);
-
-	/* write png info into file */
-	png_write_info(png_ptr, info_ptr);
-
-	/* Allocate memory for one row (3 bytes per pixel - RGB) */
-	row = (png_bytep) malloc(4 * width * sizeof(png_byte));
+void surface_free(struct surface *surf)
+{
+	free(surf->pixels);
+	free(surf->used);
+	free(surf->free);
+	free(surf->lead);
+}
 
-	/* number of passes */
-	if (interlace)
-		passes = png_set_interlace_handling(png_ptr);
-	else
-		passes = 1;
+static inline
+int surface_is_used(struct surface *surf, int x, int y)
+{
+	return (surf->used[(size_t)y * surf->words + (x >> 6)] >> (x & 63)) & 1;
+}
 
-	/* Write image data */
-	for(n=0; n<passes; n++) {
-		for (y=0 ; y<height ; y++) {
-			basey = y * width;
-			for (x=0 ; x<width ; x++) {
-
-				if (alpha != NULL)
-					basex = x * 3;
-				else
-					basex = x * 4;
-
-				/* unused pixel */
-				if (buffer[y*width + x].used == 0) {
-					row[basex+0] = 0x00;
-					row[basex+1] = 0x00;
-					row[basex+2] = 0x00;
-					row[basex+3] = 0x00;
-				}
+/* return the rightmost used pixel of the row <y> in the range
+ * [x, x+width[, or -1 if the range is free.
+ */
+static inline
+int surface_last_used(struct surface *surf, int y, int x, int width)
+{
+	uint64_t *row = &surf->used[(size_t)y * surf->words];
+	uint64_t w;
+	int last = x + width - 1;
+	int first_word = x >> 6;
+	int i;
 
-				/* compute pixel color with background color and alpha channel */
-				else if (alpha != NULL) {
-					unsigned char a = buffer[basey+x].a;
-					unsigned char r = buffer[basey+x].r;
-					unsigned char g = buffer[basey+x].g;
-					unsigned char b = buffer[basey+x].b;
-
-					row[basex+0] = appli_alpha(r, alpha->r, a) & color_mask[qual];
-					row[basex+1] = appli_alpha(g, alpha->g, a) & color_mask[qual];
-					row[basex+2] = appli_alpha(b, alpha->b, a) & color_mask[qual];
-					row[basex+3] = 0xff;
-				}
+	for (i = last >> 6; i >= first_word; i--) {
+		w = row[i];
+		if (i == last >> 6 && (last & 63) != 63)
+			w &= ((uint64_t)1 << ((last & 63) + 1)) - 1;
+		if (i == first_word)
+			w &= ~(uint64_t)0 << (x & 63);
+		if (w != 0)
+			return (i << 6) + 63 - __builtin_clzll(w);
+	}
+	return -1;
+}
 
-				/* copy pixel */
-				else if (buffer[basey+x].a != 0x00) {
-					row[basex+0] = buffer[basey+x].r & color_mask[qual];
-					row[basex+1] = buffer[basey+x].g & color_mask[qual];
-					row[basex+2] = buffer[basey+x].b & color_mask[qual];
-					row[basex+3] = buffer[basey+x].a & color_mask[qual];
-				}
+/* mark the area as used, and update the per row counters */
+static inline
+void surface_set_used(struct surface *surf, int sx, int sy, int width, int height)
+{
+	uint64_t *row;
+	uint64_t mask;
+	int last = sx + width - 1;
+	int x;
+	int y;
+	int i;
 
-				/* pixel is transparent, set to 0 */
-				else {
-					row[basex+0] = 0x00;
-					row[basex+1] = 0x00;
-					row[basex+2] = 0x00;
-					row[basex+3] = 0x00;
-				}
+	for (y=sy; y<sy+height; y++) {
+		row = &surf->used[(size_t)y * surf->words];
+		for (i = sx >> 6; i <= last >> 6; i++) {
+			mask = ~(uint64_t)0;
+			if (i == sx >> 6)
+				mask &= ~(uint64_t)0 << (sx & 63);
+			if (i == last >> 6 && (last & 63) != 63)
+				mask &= ((uint64_t)1 << ((last & 63) + 1)) - 1;
+			row[i] |= mask;
+		}
+		surf->free[y] -= width;
+
+		/* the leftmost free pixel was covered, search the next one */
+		if (surf->lead[y] >= sx && surf->lead[y] <= last) {
+			x = last + 1;
+			for (i = x >> 6; i < surf->words; i++) {
+				mask = ~row[i];
+				if (i == x >> 6)
+					mask &= ~(uint64_t)0 << (x & 63);
+				if (mask != 0)
+					break;
 			}
-			png_write_row(png_ptr, row);
+			if (i < surf->words)
+				x = (i << 6) + __builtin_ctzll(mask);
+			else
+				x = surf->width;
+			if (x > surf->width)
+				x = surf->width;
+			surf->lead[y] = x;
 		}
 	}
-
-	/* End write */
-	png_write_end(png_ptr, NULL);
-	fclose(fp);
-	png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
-	png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
-	free(row);
 }
 
-char *load_file(const char *in_file)
+/* c * a + b * (255 - a), divided by 255. The division is exact
+ * for all the values of the blend: x / 255 == (x * 0x8081) >> 23 for
+ * x <= 255 * 255.
+ */
+#define div255(__x) (((__x) * 0x8081) >> 23)
+#define appli_alpha(__c, __b, __a) \
+	div255( ( (__c * __a) + ( (__b * (255 - __a) ) ) ) )
+
+/* number of rows assembled at once by drawpng() */
+#define BAND_HEIGHT 64
+
+/* For each band of BAND_HEIGHT rows, the list of the nodes which cover
+ * at least one row of the band. The lists are stored contiguously in
+ * <nodes>, the list of the band <b> starts at first[b] and ends before
+ * first[b+1].
+ */
+struct band_index {
+	int nb;
+	int *first;
+	struct node **nodes;
+};
+
+void band_index_build(struct band_index *bi, struct node **pool, int nb_img, int height)
 {
-	struct stat buf;
-	int fd;
-	char *bloc;
+	struct node *n;
+	int *pos;
+	int i;
+	int b;
 
-	/* get size */
-	if (stat(in_file, &buf) < 0) {
-		fprintf(stderr, "cannot open file \"%s\": %s\n",
-		        in_file, strerror(errno));
+	bi->nb = (height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+	bi->first = calloc(sizeof(int), bi->nb + 1);
+	pos = calloc(sizeof(int), bi->nb + 1);
+	if (bi->first == NULL || pos == NULL) {
+		fprintf(stderr, "out of memory\n");
 		exit(1);
 	}
 
-	/* open input template file */
-	fd = open(in_file, O_RDONLY);
-	if (fd < 0) {
-		fprintf(stderr, "cannot open file \"%s\": %s\n",
-		        in_file, strerror(errno));
-		exit(1);
+	/* count the nodes of each band */
+	for (i=0; i<nb_img; i++) {
+		n = pool[i];
+		if (n->width == 0 || n->height == 0 || n->alias != NULL)
+			continue;
+		for (b = n->dest_y / BAND_HEIGHT;
+		     b <= (n->dest_y + n->height - 1) / BAND_HEIGHT;
+		     b++)
+			bi->first[b + 1]++;
 	}
+	for (b=0; b<bi->nb; b++)
+		bi->first[b + 1] += bi->first[b];
 
-	/* memory for data */
-	bloc = malloc(buf.st_size + 1);
-	if (bloc == NULL) {
+	bi->nodes = malloc(sizeof(struct node *) * (bi->first[bi->nb] + 1));
+	if (bi->nodes == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(1);
 	}
 
-	/* load data */
-	if (read(fd, bloc, buf.st_size) != buf.st_size) {
-		fprintf(stderr, "cannot read file \"%s\": %s\n",
-		        in_file, strerror(errno));
-		exit(1);
+	/* dispatch the nodes */
+	memcpy(pos, bi->first, sizeof(int) * (bi->nb + 1));
+	for (i=0; i<nb_img; i++) {
+		n = pool[i];
+		if (n->width == 0 || n->height == 0 || n->alias != NULL)
+			continue;
+		for (b = n->dest_y / BAND_HEIGHT;
+		     b <= (n->dest_y + n->height - 1) / BAND_HEIGHT;
+		     b++)
+			bi->nodes[pos[b]++] = n;
 	}
-	bloc[buf.st_size] = '\0';
-
-	/* close inpout template file */
-	close(fd);
-
-	return bloc;
+	free(pos);
 }
 
-struct template_elem *parse_tpl(const char *bloc, int *outnb)
+void band_index_free(struct band_index *bi)
 {
-	enum template_elem_type type;
-	struct template_elem *elems = NULL;
-	int nb = 0;
-	const char *p;
-	const char *var;
-	const char *nvar;
-	const char *cont;
+	free(bi->first);
+	free(bi->nodes);
+}
 
-	p = bloc;
-	while (1) {
+/*
+ * Conversion of runs of used pixels into the output colors. Transparent
+ * pixels are 0 in RGBA mode, and blended with the background with -na
+ * (RGB mode). Unused pixels are always 0. Each mode has a scalar kernel,
+ * a SSE2 one and an AVX2 one, chosen at run time.
+ */
+struct conv {
+	unsigned char mask;        /* color_mask[qual] */
+	struct color bg;           /* -na background */
+};
 
-		/* on recherche la premiere occurrence de la premiere variable */
-		var = strstr(p, VAR_WIDTH);
-		if (var !=  NULL) {
-			type = ELEM_WIDTH;
-			cont = var + strlen(VAR_WIDTH);
-		}
-		nvar = strstr(p, VAR_HEIGHT);
-		if (var == NULL || (nvar != NULL && nvar < var)) {
-			var = nvar;
-			type = ELEM_HEIGHT;
-			cont = var + strlen(VAR_HEIGHT);
-		}
-		nvar = strstr(p, VAR_OFFSETX);
-		if (var == NULL || (nvar != NULL && nvar < var)) {
-			var = nvar;
-			type = ELEM_OFFSETX;
-			cont = var + strlen(VAR_OFFSETX);
-		}
-		nvar = strstr(p, VAR_OFFSETY);
-		if (var == NULL || (nvar != NULL && nvar < var)) {
-			var = nvar;
-			type = ELEM_OFFSETY;
-			cont = var + strlen(VAR_OFFSETY);
-		}
-		nvar = strstr(p, VAR_NAME);
-		if (var == NULL || (nvar != NULL && nvar < var)) {
-			var = nvar;
-			type = ELEM_NAME;
-			cont = var + strlen(VAR_NAME);
-		}
-		nvar = strstr(p, VAR_AZNAME);
-		if (var == NULL || (nvar != NULL && nvar < var)) {
-			var = nvar;
-			type = ELEM_AZNAME;
-			cont = var + strlen(VAR_AZNAME);
-		}
-		nvar = strstr(p, VAR_HASH);
-		if (var == NULL || (nvar != NULL && nvar < var)) {
-			var = nvar;
-			type = ELEM_HASH;
-			cont = var + strlen(VAR_HASH);
-		}
-		nvar = strstr(p, VAR_OUTPUT);
-		if (var == NULL || (nvar != NULL && nvar < var)) {
-			var = nvar;
-			type = ELEM_OUTPUT;
-			cont = var + strlen(VAR_OUTPUT);
-		}
-		nvar = strstr(p, VAR_ID);
-		if (var == NULL || (nvar != NULL && nvar < var)) {
-			var = nvar;
-			type = ELEM_ID;
-			cont = var + strlen(VAR_ID);
-		}
-
-		/* copy string if is not empty */
-		if (p != var) {
-			nb++;
-			elems = realloc(elems, sizeof(struct template_elem) * nb);
-			if (elems == NULL) {
-				fprintf(stderr, "out of memory\n");
-				exit(1);
-			}
-			if (!var) {
-				elems[nb-1].string = strdup(p);
-			}
-			else {
-				elems[nb-1].string = malloc(var - p + 1);
-				memcpy(elems[nb-1].string, p, var - p);
-				elems[nb-1].string[var - p] = '\0';
-			}
-			elems[nb-1].type = ELEM_STRING;
-		}
+typedef void (*conv_fn)(png_bytep out, const unsigned char *pix, int n,
+                        const struct conv *c);
 
-		/* copy variable element */
-		if (var != NULL) {
-			nb++;
-			elems = realloc(elems, sizeof(struct template_elem) * nb);
-			if (elems == NULL) {
-				fprintf(stderr, "out of memory\n");
-				exit(1);
-			}
-			elems[nb-1].string = NULL;
-			elems[nb-1].type = type;
-		}
+/* RGBA: copy and mask, transparent pixels are 0 */
+static
+void conv_rgba_c(png_bytep out, const unsigned char *pix, int n, const struct conv *c)
+{
+	uint32_t mask = c->mask * 0x01010101U;
+	uint32_t v;
+	int x;
 
-		/* is the end of parsing */
-		else
-			break;
-		
-		/* continue parsing */
-		p = cont;
+	for (x=0; x<n; x++) {
+		memcpy(&v, &pix[x * 4], 4);
+		/* all 1 if alpha is not 0 */
+		v &= mask & -(uint32_t)(pix[x * 4 + 3] != 0);
+		memcpy(&out[x * 4], &v, 4);
 	}
-
-	*outnb = nb;
-	return elems;
 }
 
-struct template *load_tpl(const char *in_file, const char *hdr, const char *foot, const char *out_file)
+/* RGB: blend with the background, and pack the 3 colors */
+static
+void conv_blend_c(png_bytep out, const unsigned char *pix, int n, const struct conv *c)
 {
-	struct template *tpl;
-	char *bloc;
+	unsigned int a;
+	int x;
 
-	/* memory for the template */
-	tpl = calloc(sizeof(struct template), 1);
-	if (tpl == NULL) {
-		fprintf(stderr, "out of memory\n");
-		exit(1);
+	for (x=0; x<n; x++) {
+		a = pix[x * 4 + 3];
+		out[x * 3]     = appli_alpha(pix[x * 4],     c->bg.r, a) & c->mask;
+		out[x * 3 + 1] = appli_alpha(pix[x * 4 + 1], c->bg.g, a) & c->mask;
+		out[x * 3 + 2] = appli_alpha(pix[x * 4 + 2], c->bg.b, a) & c->mask;
 	}
+}
 
-	/* Load header file */
-	if (hdr) {
-		bloc = load_file(hdr);
-		tpl->elems[0] = parse_tpl(bloc, &tpl->nb[0]);
-	}
+#ifdef __SSE2__
+#include <emmintrin.h>
 
-	/* Load "each line" template */
-	bloc = load_file(in_file);
-	tpl->elems[1] = parse_tpl(bloc, &tpl->nb[1]);
+static
+void conv_rgba_sse2(png_bytep out, const unsigned char *pix, int n, const struct conv *c)
+{
+	__m128i mask = _mm_set1_epi8(c->mask);
+	__m128i amask = _mm_set1_epi32(0xff000000);
+	__m128i zero = _mm_setzero_si128();
+	__m128i v;
+	__m128i t;
+	int x;
 
-	/* Load footer file */
-	if (foot)
-		bloc = load_file(foot);
-		tpl->elems[2] = parse_tpl(bloc, &tpl->nb[2]);
+	for (x=0; x+4<=n; x+=4) {
+		v = _mm_loadu_si128((const __m128i *)&pix[x * 4]);
+		t = _mm_cmpeq_epi32(_mm_and_si128(v, amask), zero);
+		v = _mm_andnot_si128(t, _mm_and_si128(v, mask));
+		_mm_storeu_si128((__m128i *)&out[x * 4], v);
+	}
+	conv_rgba_c(out + x * 4, pix + x * 4, n - x, c);
+}
 
-	/* open output template file */
-	tpl->fh = fopen(out_file, "w");
-	if (tpl->fh == NULL) {
-		fprintf(stderr, "cannot open file \"%s\": %s\n",
-		        out_file, strerror(errno));
-		exit(1);
+/* blend 2 pixels unpacked in 16 bits words */
+static inline
+__m128i blend16_sse2(__m128i v, __m128i bg, __m128i full)
+{
+	__m128i a;
+
+	a = _mm_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	v = _mm_add_epi16(_mm_mullo_epi16(v, a),
+	                  _mm_mullo_epi16(bg, _mm_sub_epi16(full, a)));
+	return _mm_srli_epi16(_mm_mulhi_epu16(v, _mm_set1_epi16(0x8081)), 7);
+}
+
+static
+void conv_blend_sse2(png_bytep out, const unsigned char *pix, int n, const struct conv *c)
+{
+	__m128i mask = _mm_set1_epi8(c->mask);
+	__m128i bg = _mm_setr_epi16(c->bg.r, c->bg.g, c->bg.b, 0,
+	                            c->bg.r, c->bg.g, c->bg.b, 0);
+	__m128i full = _mm_set1_epi16(255);
+	__m128i zero = _mm_setzero_si128();
+	__m128i v;
+	__m128i lo;
+	__m128i hi;
+	unsigned char tmp[16];
+	int x;
+
+	for (x=0; x+4<=n; x+=4) {
+		v = _mm_loadu_si128((const __m128i *)&pix[x * 4]);
+		lo = blend16_sse2(_mm_unpacklo_epi8(v, zero), bg, full);
+		hi = blend16_sse2(_mm_unpackhi_epi8(v, zero), bg, full);
+		v = _mm_and_si128(_mm_packus_epi16(lo, hi), mask);
+		_mm_storeu_si128((__m128i *)tmp, v);
+
+		/* pack RGB */
+		memcpy(&out[x * 3], &tmp[0], 3);
+		memcpy(&out[x * 3 + 3], &tmp[4], 3);
+		memcpy(&out[x * 3 + 6], &tmp[8], 3);
+		memcpy(&out[x * 3 + 9], &tmp[12], 3);
 	}
+	conv_blend_c(out + x * 3, pix + x * 4, n - x, c);
+}
+#endif
 
-	return tpl;
+#ifdef HAVE_AVX2_DISPATCH
+__attribute__((target("avx2")))
+static
+void conv_rgba_avx2(png_bytep out, const unsigned char *pix, int n, const struct conv *c)
+{
+	__m256i mask = _mm256_set1_epi8(c->mask);
+	__m256i amask = _mm256_set1_epi32(0xff000000);
+	__m256i zero = _mm256_setzero_si256();
+	__m256i v;
+	__m256i t;
+	int x;
+
+	for (x=0; x+8<=n; x+=8) {
+		v = _mm256_loadu_si256((const __m256i *)&pix[x * 4]);
+		t = _mm256_cmpeq_epi32(_mm256_and_si256(v, amask), zero);
+		v = _mm256_andnot_si256(t, _mm256_and_si256(v, mask));
+		_mm256_storeu_si256((__m256i *)&out[x * 4], v);
+	}
+	conv_rgba_c(out + x * 4, pix + x * 4, n - x, c);
+}
+
+__attribute__((target("avx2")))
+static inline
+__m256i blend16_avx2(__m256i v, __m256i bg, __m256i full)
+{
+	__m256i a;
+
+	a = _mm256_shufflelo_epi16(v, _MM_SHUFFLE(3, 3, 3, 3));
+	a = _mm256_shufflehi_epi16(a, _MM_SHUFFLE(3, 3, 3, 3));
+	v = _mm256_add_epi16(_mm256_mullo_epi16(v, a),
+	                     _mm256_mullo_epi16(bg, _mm256_sub_epi16(full, a)));
+	return _mm256_srli_epi16(_mm256_mulhi_epu16(v, _mm256_set1_epi16(0x8081)), 7);
+}
+
+__attribute__((target("avx2")))
+static
+void conv_blend_avx2(png_bytep out, const unsigned char *pix, int n, const struct conv *c)
+{
+	__m256i mask = _mm256_set1_epi8(c->mask);
+	__m256i bg = _mm256_setr_epi16(c->bg.r, c->bg.g, c->bg.b, 0,
+	                               c->bg.r, c->bg.g, c->bg.b, 0,
+	                               c->bg.r, c->bg.g, c->bg.b, 0,
+	                               c->bg.r, c->bg.g, c->bg.b, 0);
+	__m256i full = _mm256_set1_epi16(255);
+	__m256i zero = _mm256_setzero_si256();
+	/* in each lane, the 4 RGB triplets first */
+	__m256i pack = _mm256_setr_epi8(0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1,
+	                                0, 1, 2, 4, 5, 6, 8, 9, 10, 12, 13, 14, -1, -1, -1, -1);
+	__m256i v;
+	__m256i lo;
+	__m256i hi;
+	unsigned char tmp[32];
+	int x;
+
+	for (x=0; x+8<=n; x+=8) {
+		v = _mm256_loadu_si256((const __m256i *)&pix[x * 4]);
+		lo = blend16_avx2(_mm256_unpacklo_epi8(v, zero), bg, full);
+		hi = blend16_avx2(_mm256_unpackhi_epi8(v, zero), bg, full);
+		v = _mm256_and_si256(_mm256_packus_epi16(lo, hi), mask);
+		v = _mm256_shuffle_epi8(v, pack);
+		_mm256_storeu_si256((__m256i *)tmp, v);
+		memcpy(&out[x * 3], &tmp[0], 12);
+		memcpy(&out[x * 3 + 12], &tmp[16], 12);
+	}
+	conv_blend_c(out + x * 3, pix + x * 4, n - x, c);
+}
+#endif
+
+/* the kernel of the mode: with background (-na) or not */
+conv_fn conv_select(int blend)
+{
+#ifdef HAVE_AVX2_DISPATCH
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2"))
+		return blend ? conv_blend_avx2 : conv_rgba_avx2;
+#endif
+#ifdef __SSE2__
+	return blend ? conv_blend_sse2 : conv_rgba_sse2;
+#else
+	return blend ? conv_blend_c : conv_rgba_c;
+#endif
 }
 
-void exec_tpl(struct template *tpl, int idx, struct node *node, struct general *gen, int id)
+/*
+ * Downscale of the images for the lower scales of --scales. The filter is
+ * the area average: each output pixel is the mean of the input pixels it
+ * covers, weighted by the covered part, so the factor may be fractional
+ * (3 to 2). The mean is done with premultiplied alpha, so the colors of
+ * the transparent pixels do not leak on the edges. Out of the image, the
+ * pixels are transparent: the filter never mixes two neighbour images of
+ * the sheet.
+ */
+#define SCALE_MAX 8
+
+/* the input pixels of one output pixel, on one axis */
+struct scale_tap {
+	int first;
+	int nb;
+	float w[SCALE_MAX + 1];
+};
+
+/* taps of the <dn> output pixels of an axis of <sn> input pixels, reduced
+ * from the density <from> to <to>. The output pixel i covers the input
+ * pixels [i * from / to, (i + 1) * from / to[.
+ */
+void scale_taps(struct scale_tap *t, int dn, int sn, int from, int to)
 {
+	long long s0;
+	long long s1;
+	long long lo;
+	long long hi;
+	long long j;
 	int i;
 
-	for (i=0; i<tpl->nb[idx]; i++) {
-		switch(tpl->elems[idx][i].type) {
-		case ELEM_STRING:
-			fprintf(tpl->fh, "%s", tpl->elems[idx][i].string);
-			break;
-		case ELEM_WIDTH:
-			fprintf(tpl->fh, "%lu", node->width);
-			break;
-		case ELEM_HEIGHT:
-			fprintf(tpl->fh, "%lu", node->height);
-			break;
-		case ELEM_OFFSETX:
-			fprintf(tpl->fh, "%lu", node->dest_x);
-			break;
-		case ELEM_OFFSETY:
-			fprintf(tpl->fh, "%lu", node->dest_y);
-			break;
-		case ELEM_NAME:
-			fprintf(tpl->fh, "%s", node->name);
-			break;
-		case ELEM_AZNAME:
-			fprintf(tpl->fh, "%s", node->azname);
-			break;
-		case ELEM_HASH:
-			fprintf(tpl->fh, "%08x", gen->hash);
-			break;
-		case ELEM_OUTPUT:
-			fprintf(tpl->fh, "%s", gen->output);
-			break;
-		case ELEM_ID:
-			fprintf(tpl->fh, "%d", id);
-			break;
+	for (i=0; i<dn; i++) {
+		s0 = (long long)i * from;
+		s1 = s0 + from;
+		t[i].first = s0 / to;
+		t[i].nb = 0;
+		for (j=t[i].first; j<sn && j*to < s1; j++) {
+			lo = j * to > s0 ? j * to : s0;
+			hi = (j + 1) * to < s1 ? (j + 1) * to : s1;
+			t[i].w[t[i].nb++] = (float)(hi - lo) / from;
 		}
 	}
 }
 
-void close_tpl(struct template *tpl, struct general *general)
-{
-	struct node stnode;
+typedef void (*scale_fn)(float *acc, const unsigned char *pix,
+                         const struct scale_tap *t, int n, float wy);
 
-	stnode.width = 0;
-	stnode.height = 0;
-	stnode.dest_x = 0;
-	stnode.dest_y = 0;
-	stnode.name = "";
-	stnode.azname = "";
+/* add to <acc> the <n> output pixels of the input row <pix>, weighted by
+ * <wy>: red, green and blue premultiplied by the alpha, and the alpha.
+ */
+void scale_row_c(float *acc, const unsigned char *pix, const struct scale_tap *t,
+                 int n, float wy)
+{
+	const unsigned char *p;
+	float r, g, b, a, w;
+	int x;
+	int k;
+
+	for (x=0; x<n; x++) {
+		r = g = b = a = 0;
+		for (k=0; k<t[x].nb; k++) {
+			p = &pix[(t[x].first + k) * 4];
+			w = t[x].w[k] * p[3];
+			r += w * p[0];
+			g += w * p[1];
+			b += w * p[2];
+			a += w;
+		}
+		acc[x * 4]     += wy * r;
+		acc[x * 4 + 1] += wy * g;
+		acc[x * 4 + 2] += wy * b;
+		acc[x * 4 + 3] += wy * a;
+	}
+}
 
-	exec_tpl(tpl, 2, &stnode, general, 0);
+#ifdef __SSE2__
+/* the same with one pixel in the 4 lanes */
+void scale_row_sse2(float *acc, const unsigned char *pix, const struct scale_tap *t,
+                    int n, float wy)
+{
+	__m128i zero = _mm_setzero_si128();
+	__m128 amask = _mm_castsi128_ps(_mm_setr_epi32(0, 0, 0, -1));
+	__m128 one = _mm_set1_ps(1);
+	__m128 vwy = _mm_set1_ps(wy);
+	__m128 s;
+	__m128 v;
+	__m128 w;
+	uint32_t u;
+	int x;
+	int k;
+
+	for (x=0; x<n; x++) {
+		s = _mm_setzero_ps();
+		for (k=0; k<t[x].nb; k++) {
+			memcpy(&u, &pix[(t[x].first + k) * 4], 4);
+			v = _mm_cvtepi32_ps(_mm_unpacklo_epi16(
+			        _mm_unpacklo_epi8(_mm_cvtsi32_si128(u), zero), zero));
+
+			/* weight x (a, a, a, 1) */
+			w = _mm_or_ps(_mm_andnot_ps(amask, _mm_shuffle_ps(v, v, 0xff)),
+			              _mm_and_ps(amask, one));
+			w = _mm_mul_ps(w, _mm_set1_ps(t[x].w[k]));
+			s = _mm_add_ps(s, _mm_mul_ps(v, w));
+		}
+		_mm_storeu_ps(&acc[x * 4],
+		              _mm_add_ps(_mm_loadu_ps(&acc[x * 4]), _mm_mul_ps(s, vwy)));
+	}
+}
+#endif
 
-	fclose(tpl->fh);
+scale_fn scale_select(void)
+{
+#ifdef __SSE2__
+	return scale_row_sse2;
+#else
+	return scale_row_c;
+#endif
 }
 
 static inline
-int check_size(struct surface *surf, int larg, int sx, int sy, int width, int height)
+unsigned char scale_clamp(float v)
+{
+	return v >= 255 ? 255 : (unsigned char)(v + 0.5f);
+}
+
+/* reduce the image <src> into <dst>, from the density <from> to <to>. The
+ * size of <dst> is set, its pixels are allocated.
+ */
+void downscale(struct node *src, struct node *dst, int from, int to)
 {
+	struct scale_tap *tx;
+	struct scale_tap *ty;
+	scale_fn row = scale_select();
+	unsigned char *out;
+	float *acc;
+	float a;
 	int x;
 	int y;
-	int base;
-
-	for (y=sy; y<sy+height; y++) {
-		base = y * larg;
-		for (x=sx; x<sx+width; x++)
-			if (surf[base + x].used != 0)
-				return 0;
+	int k;
+
+	dst->width = ((long long)src->width * to + from - 1) / from;
+	dst->height = ((long long)src->height * to + from - 1) / from;
+	dst->surface = dst->width * dst->height;
+	dst->stride = (size_t)dst->width * 4;
+	dst->pixels = malloc(dst->stride * dst->height + 1);
+	tx = malloc(sizeof(struct scale_tap) * (dst->width + 1));
+	ty = malloc(sizeof(struct scale_tap) * (dst->height + 1));
+	acc = malloc(sizeof(float) * 4 * (dst->width + 1));
+	if (dst->pixels == NULL || tx == NULL || ty == NULL || acc == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
 	}
-	return 1;
+	scale_taps(tx, dst->width, src->width, from, to);
+	scale_taps(ty, dst->height, src->height, from, to);
+
+	for (y=0; y<dst->height; y++) {
+		memset(acc, 0, sizeof(float) * 4 * dst->width);
+		for (k=0; k<ty[y].nb; k++)
+			row(acc, node_row(src, ty[y].first + k), tx, dst->width, ty[y].w[k]);
+
+		/* back from the premultiplied colors */
+		out = node_row(dst, y);
+		for (x=0; x<dst->width; x++) {
+			a = acc[x * 4 + 3];
+			if (a < 0.5f) {
+				memset(&out[x * 4], 0, 4);
+				continue;
+			}
+			out[x * 4]     = scale_clamp(acc[x * 4] / a);
+			out[x * 4 + 1] = scale_clamp(acc[x * 4 + 1] / a);
+			out[x * 4 + 2] = scale_clamp(acc[x * 4 + 2] / a);
+			out[x * 4 + 3] = scale_clamp(a);
+		}
+	}
+	free(tx);
+	free(ty);
+	free(acc);
 }
 
-static inline
-void fill(struct surface *surf, int larg, int sx, int sy, struct node *n)
+struct palette;
+
+/* everything needed to build the rows of the output image */
+struct draw {
+	struct surface *surf;
+	struct band_index bi;   /* streaming mode only */
+	int width;
+	int height;
+	int cbpp;               /* bytes per pixel of the colors (3 or 4) */
+	int color_type;         /* output format */
+	int depth;
+	int key;                /* the transparent pixels are a tRNS color key */
+	int bpp;                /* bytes per pixel of the output rows, for the filters */
+	size_t rowbytes;        /* bytes per output row */
+	struct palette *pal;    /* palette mode only */
+	int qual;
+	struct color *alpha;
+	conv_fn conv;           /* color conversion kernel */
+	struct conv cv;
+};
+
+/* build the rows [y0, y0+nb[ into <band> from the canvas. Without
+ * background, the unused pixels of the canvas are 0 and give 0, so the
+ * full rows are converted. With a background, only the runs of used
+ * pixels are converted.
+ */
+static
+void draw_band_canvas(struct draw *d, int y0, int nb, png_bytep band)
 {
+	struct surface *surf = d->surf;
+	unsigned char *pix;
+	png_bytep row;
+	uint64_t *used;
+	uint64_t w;
+	int start;
+	int end;
 	int x;
 	int y;
-	int base;
-	int py;
-	int px;
 
-	py = 0;
-	for (y=sy; y<sy+n->height; y++) {
-		base = y * larg;
-		px = 0;
-		for (x=sx; x<sx+n->width; x++) {
-			surf[base + x].used = 1;
-			surf[base + x].r = n->row_pointers[py][px+0];
-			surf[base + x].g = n->row_pointers[py][px+1];
-			surf[base + x].b = n->row_pointers[py][px+2];
-			surf[base + x].a = n->row_pointers[py][px+3];
-			px += 4;
+	for (y=y0; y<y0+nb; y++) {
+		row = band + (size_t)(y - y0) * surf->width * d->cbpp;
+		pix = (unsigned char *)&surf->pixels[(size_t)y * surf->width];
+		if (d->alpha == NULL) {
+			d->conv(row, pix, surf->width, &d->cv);
+			continue;
+		}
+
+		used = &surf->used[(size_t)y * surf->words];
+		for (x=0; x<surf->words; x++) {
+			w = used[x];
+			while (w != 0) {
+				/* run of set bits in the word */
+				start = __builtin_ctzll(w);
+				end = ~(w >> start) == 0 ? 64 : start + __builtin_ctzll(~(w >> start));
+				d->conv(&row[(x * 64 + start) * d->cbpp],
+				        &pix[(x * 64 + start) * 4], end - start, &d->cv);
+				w = end == 64 ? 0 : w & (~0ULL << end);
+			}
 		}
-		py++;
 	}
 }
 
-int compar(const void *ia, const void *ib)
+/* build the rows [y0, y0+nb[ into <band> from the input images which
+ * cover the band <b>. The rows must be inside the band.
+ */
+static
+void draw_band_nodes(struct draw *d, int b, int y0, int nb, png_bytep band)
 {
-	const struct node * const *ia1 = ia;
-	const struct node * const *ib1 = ib;
-	const struct node *a = *ia1;
-	const struct node *b = *ib1;
+	struct band_index *bi = &d->bi;
+	struct node *n;
+	png_bytep row;
+	int ys;
+	int ye;
+	int y;
+	int i;
 
-	return a->surface < b->surface;
+	for (i=bi->first[b]; i<bi->first[b + 1]; i++) {
+		n = bi->nodes[i];
+
+		/* rows of the node inside the band */
+		ys = n->dest_y > y0 ? n->dest_y : y0;
+		ye = n->dest_y + n->height < y0 + nb ? n->dest_y + n->height : y0 + nb;
+
+		for (y=ys; y<ye; y++) {
+			row = band + ((size_t)(y - y0) * d->width + n->dest_x) * d->cbpp;
+			d->conv(row, node_row(n, y - n->dest_y), n->width, &d->cv);
+		}
+	}
 }
 
-char *do_azname(const char *name)
+/* build any rows [y0, y0+nb[ of the output image into <out>, with the
+ * colors of the pixels (RGB or RGBA). This is thread safe.
+ */
+void draw_rows_color(struct draw *d, int y0, int nb, png_bytep out)
 {
-	char *p;
-	char *n;
+	size_t rowbytes = (size_t)d->width * d->cbpp;
+	int ys;
+	int ye;
+	int b;
 
-	/* search path component */
-	p = strchr(name, '/');
-	if (p == NULL)
-		p = (char *)name;
-	else
-		p++;
+	/* unused pixels are 0 */
+	memset(out, 0, rowbytes * nb);
 
-	/* copy name without path component */
-	n = strdup(p);
-	if (n == NULL) {
+	if (d->surf->pixels != NULL) {
+		draw_band_canvas(d, y0, nb, out);
+		return;
+	}
+
+	/* the rows may cover several bands of the index */
+	for (b = y0 / BAND_HEIGHT; b <= (y0 + nb - 1) / BAND_HEIGHT; b++) {
+		ys = b * BAND_HEIGHT > y0 ? b * BAND_HEIGHT : y0;
+		ye = (b + 1) * BAND_HEIGHT < y0 + nb ? (b + 1) * BAND_HEIGHT : y0 + nb;
+		draw_band_nodes(d, b, ys, ye - ys, out + rowbytes * (ys - y0));
+	}
+}
+
+/*
+ * Palette. The colors of the output image are counted in a hash table.
+ * If there are more colors than the palette size, the palette is built
+ * by median cut on this histogram, then refined by a few iterations of
+ * k-means. The nearest palette entry of each color is stored in the
+ * hash table, so mapping a pixel is only a lookup.
+ */
+#define KMEANS_ITER 3
+
+struct pal_color {
+	uint32_t rgba;
+	uint32_t count;   /* 0: free slot */
+	int index;        /* palette entry */
+};
+
+struct palette {
+	struct pal_color *colors;   /* hash table */
+	size_t size;                /* power of 2 */
+	int bits;                   /* log2(size) */
+	size_t nb;
+	int nb_entries;
+	unsigned char entries[256][4];
+	int nb_trans;               /* entries with alpha, at the begining */
+};
+
+static inline
+uint32_t pal_pack(const unsigned char *pix, int cbpp)
+{
+	return pix[0] | (pix[1] << 8) | (pix[2] << 16) |
+	       ((uint32_t)(cbpp == 4 ? pix[3] : 0xff) << 24);
+}
+
+static inline
+struct pal_color *pal_lookup(struct palette *pal, uint32_t rgba)
+{
+	size_t i;
+
+	/* the high bits of the product, the low ones only depend on the
+	 * low bits of the red channel
+	 */
+	i = (uint32_t)(rgba * 0x9e3779b1U) >> (32 - pal->bits);
+	while (pal->colors[i].count != 0 && pal->colors[i].rgba != rgba)
+		i = (i + 1) & (pal->size - 1);
+	return &pal->colors[i];
+}
+
+void pal_add(struct palette *pal, uint32_t rgba)
+{
+	struct pal_color *old;
+	struct pal_color *c;
+	size_t size;
+	size_t i;
+
+	c = pal_lookup(pal, rgba);
+	if (c->count != 0) {
+		c->count++;
+		return;
+	}
+	c->rgba = rgba;
+	c->count = 1;
+	pal->nb++;
+
+	/* keep the table half empty */
+	if (pal->nb * 2 <= pal->size)
+		return;
+	old = pal->colors;
+	size = pal->size;
+	pal->size *= 2;
+	pal->bits++;
+	pal->colors = calloc(sizeof(struct pal_color), pal->size);
+	if (pal->colors == NULL) {
 		fprintf(stderr, "out of memory\n");
 		exit(1);
 	}
+	for (i=0; i<size; i++)
+		if (old[i].count != 0)
+			*pal_lookup(pal, old[i].rgba) = old[i];
+	free(old);
+}
 
-	/* remove extension */
-	p = strrchr(n, '.');
-	if (p != NULL)
-		*p = '\0';
+static inline
+int pal_channel(uint32_t rgba, int c)
+{
+	return (rgba >> (c * 8)) & 0xff;
+}
 
-	/* check each char */
-	for (p = n;
-	     *p != '\0';
-	     p++) {
+static inline
+unsigned int pal_dist(uint32_t rgba, const unsigned char *e)
+{
+	unsigned int d = 0;
+	int v;
+	int c;
 
-		/* lower case */
-		if (*p >= 'A' && *p <= 'Z')
-			*p = tolower(*p);
+	for (c=0; c<4; c++) {
+		v = pal_channel(rgba, c) - e[c];
+		d += v * v;
+	}
+	return d;
+}
 
-		/* replace bad char */
-		if ( (*p < 'a' || *p > 'z') &&
-		     (*p < '0' || *p > '9') &&
-		     *p != '_')
-			*p = '_';
+/* nearest entry of the palette */
+int pal_nearest(struct palette *pal, uint32_t rgba)
+{
+	unsigned int best_dist = ~0U;
+	unsigned int dist;
+	int best = 0;
+	int i;
+
+	for (i=0; i<pal->nb_entries; i++) {
+		dist = pal_dist(rgba, pal->entries[i]);
+		if (dist < best_dist) {
+			best_dist = dist;
+			best = i;
+			if (dist == 0)
+				break;
+		}
 	}
+	return best;
+}
 
-	return n;
+static int pal_sort_channel;
+
+int compar_channel(const void *a, const void *b)
+{
+	const struct pal_color *ca = a;
+	const struct pal_color *cb = b;
+
+	return pal_channel(ca->rgba, pal_sort_channel) -
+	       pal_channel(cb->rgba, pal_sort_channel);
 }
 
-static inline
-int hex_conv(char c)
+/* a box of the median cut: the colors [first, last[ */
+struct pal_box {
+	int first;
+	int last;
+	int channel;   /* widest channel */
+	int range;
+	uint64_t count;
+};
+
+void pal_box_update(struct pal_box *box, struct pal_color *colors)
 {
-	if (c >= '0' && c <= '9')
-		return c - '0';
-	if (c >= 'a' && c <= 'f')
-		return c - 'a' + 10;
-	if (c >= 'A' && c <= 'F')
-		return c - 'A' + 10;
-	return -1;
+	int min[4] = { 255, 255, 255, 255 };
+	int max[4] = { 0, 0, 0, 0 };
+	int v;
+	int c;
+	int i;
+
+	box->count = 0;
+	for (i=box->first; i<box->last; i++) {
+		box->count += colors[i].count;
+		for (c=0; c<4; c++) {
+			v = pal_channel(colors[i].rgba, c);
+			if (v < min[c])
+				min[c] = v;
+			if (v > max[c])
+				max[c] = v;
+		}
+	}
+	box->range = -1;
+	for (c=0; c<4; c++) {
+		if (max[c] - min[c] > box->range) {
+			box->range = max[c] - min[c];
+			box->channel = c;
+		}
+	}
 }
 
-static inline
-int byte_conv(char *c)
+/* build the <nb_entries> entries of the palette from the histogram */
+void pal_build(struct palette *pal, int nb_entries)
 {
-	int res1;
-	int res2;
+	struct pal_color *colors;
+	struct pal_box boxes[256];
+	uint64_t sum[256][4];
+	uint64_t cnt[256];
+	uint64_t half;
+	uint64_t acc;
+	int nb_boxes;
+	int best;
+	int iter;
+	int mid;
+	int c;
+	int i;
+	int j;
+	size_t k;
 
-	res1 = hex_conv(c[0]);
-	res2 = hex_conv(c[1]);
-	if (res1 < 0 || res2 < 0)
-		return -1;
-	return ( res1 << 4 ) + res2;
+	/* colors of the histogram */
+	colors = malloc(sizeof(struct pal_color) * pal->nb);
+	if (colors == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (k=0, i=0; k<pal->size; k++)
+		if (pal->colors[k].count != 0)
+			colors[i++] = pal->colors[k];
+
+	/* median cut: split the box with the widest channel, weighted by
+	 * its number of pixels, at the median pixel.
+	 */
+	boxes[0].first = 0;
+	boxes[0].last = pal->nb;
+	pal_box_update(&boxes[0], colors);
+	nb_boxes = 1;
+	while (nb_boxes < nb_entries) {
+		best = -1;
+		for (i=0; i<nb_boxes; i++) {
+			if (boxes[i].last - boxes[i].first < 2)
+				continue;
+			if (best < 0 ||
+			    (uint64_t)boxes[i].range * boxes[i].count >
+			    (uint64_t)boxes[best].range * boxes[best].count)
+				best = i;
+		}
+		if (best < 0)
+			break;
+
+		pal_sort_channel = boxes[best].channel;
+		qsort(&colors[boxes[best].first], boxes[best].last - boxes[best].first,
+		      sizeof(struct pal_color), compar_channel);
+		half = boxes[best].count / 2;
+		acc = 0;
+		for (mid=boxes[best].first + 1; mid<boxes[best].last - 1; mid++) {
+			acc += colors[mid - 1].count;
+			if (acc >= half)
+				break;
+		}
+
+		boxes[nb_boxes].first = mid;
+		boxes[nb_boxes].last = boxes[best].last;
+		boxes[best].last = mid;
+		pal_box_update(&boxes[best], colors);
+		pal_box_update(&boxes[nb_boxes], colors);
+		nb_boxes++;
+	}
+
+	/* the entries are the means of the boxes */
+	for (i=0; i<nb_boxes; i++)
+		for (j=boxes[i].first; j<boxes[i].last; j++)
+			colors[j].index = i;
+	pal->nb_entries = nb_boxes;
+
+	/* k-means: the entries are moved to the mean of their colors, then
+	 * the colors are assigned to the nearest entry.
+	 */
+	for (iter=0; iter<=KMEANS_ITER; iter++) {
+		memset(sum, 0, sizeof(sum));
+		memset(cnt, 0, sizeof(cnt));
+		for (k=0; k<pal->nb; k++) {
+			for (c=0; c<4; c++)
+				sum[colors[k].index][c] += (uint64_t)pal_channel(colors[k].rgba, c) * colors[k].count;
+			cnt[colors[k].index] += colors[k].count;
+		}
+		for (i=0; i<pal->nb_entries; i++) {
+			if (cnt[i] == 0)
+				continue;
+			for (c=0; c<4; c++)
+				pal->entries[i][c] = (sum[i][c] + cnt[i] / 2) / cnt[i];
+		}
+		if (iter == KMEANS_ITER)
+			break;
+		for (k=0; k<pal->nb; k++)
+			colors[k].index = pal_nearest(pal, colors[k].rgba);
+	}
+
+	free(colors);
 }
 
-static inline
-int color_conv(char *in, struct color *c)
+struct palette *pal_new(void)
 {
-	int r;
-	int g;
-	int b;
+	struct palette *pal;
 
-	r = byte_conv(&in[0]);
-	g = byte_conv(&in[2]);
-	b = byte_conv(&in[4]);
+	pal = calloc(sizeof(struct palette), 1);
+	if (pal == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	pal->size = 1024;
+	pal->bits = 10;
+	pal->colors = calloc(sizeof(struct pal_color), pal->size);
+	if (pal->colors == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return pal;
+}
 
-	if (r < 0 || g < 0 || b < 0)
-		return -1;
+/* build the palette from the histogram, with at most <nb_entries>
+ * entries.
+ */
+void pal_finish(struct palette *pal, int nb_entries)
+{
+	size_t k;
+	int *order;
+	int nb;
+	int i;
+
+	/* few colors: the palette is exact */
+	if (pal->nb <= nb_entries) {
+		pal->nb_entries = 0;
+		for (k=0; k<pal->size; k++) {
+			if (pal->colors[k].count == 0)
+				continue;
+			for (i=0; i<4; i++)
+				pal->entries[pal->nb_entries][i] = pal_channel(pal->colors[k].rgba, i);
+			pal->nb_entries++;
+		}
+	}
+	else
+		pal_build(pal, nb_entries);
+
+	/* the entries with alpha first, so the tRNS chunk is short */
+	order = malloc(sizeof(int) * pal->nb_entries);
+	if (order == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	nb = 0;
+	for (i=0; i<pal->nb_entries; i++)
+		if (pal->entries[i][3] != 0xff)
+			order[nb++] = i;
+	pal->nb_trans = nb;
+	for (i=0; i<pal->nb_entries; i++)
+		if (pal->entries[i][3] == 0xff)
+			order[nb++] = i;
+	{
+		unsigned char entries[256][4];
+
+		for (i=0; i<pal->nb_entries; i++)
+			memcpy(entries[i], pal->entries[order[i]], 4);
+		memcpy(pal->entries, entries, sizeof(entries));
+	}
+	free(order);
+
+	/* nearest entry of each color */
+	for (k=0; k<pal->size; k++) {
+		if (pal->colors[k].count == 0)
+			continue;
+		pal->colors[k].index = pal_nearest(pal, pal->colors[k].rgba);
+	}
+}
+
+void pal_free(struct palette *pal)
+{
+	free(pal->colors);
+	free(pal);
+}
+
+/*
+ * Color reduction. One pass over the output image finds which lossless
+ * representation can be used: gray levels, no alpha, alpha only used to
+ * make the unused pixels transparent (this can be a tRNS color key), or
+ * less than 256 colors. The smallest one is written.
+ */
+struct colorinfo {
+	int opaque;       /* all the pixels are opaque */
+	int binary;       /* alpha is 0 or 255 and opaque black is not used,
+	                   * so the transparent pixels (0) can be a color key */
+	int gray;         /* r == g == b for all the pixels */
+	int gray_depth;   /* bits needed by the gray levels */
+};
+
+/* bits needed to store the level <v> without loss: the levels of depth
+ * d are the multiples of 255 / (2^d - 1).
+ */
+static inline
+int level_depth(int v)
+{
+	if (v % 255 == 0)
+		return 1;
+	if (v % 85 == 0)
+		return 2;
+	if (v % 17 == 0)
+		return 4;
+	return 8;
+}
+
+/* scan the output image, fill <ci> and the histogram of <pal>. With <cap>,
+ * the histogram stops when it contains more than <cap> colors.
+ */
+void color_scan(struct draw *d, struct palette *pal, int cap, struct colorinfo *ci)
+{
+	png_bytep band;
+	png_bytep pix;
+	size_t rowbytes = (size_t)d->width * d->cbpp;
+	int black = 0;
+	int depth;
+	int nb;
+	int x;
+	int y;
+
+	ci->opaque = 1;
+	ci->binary = 1;
+	ci->gray = 1;
+	ci->gray_depth = 1;
+
+	band = malloc(rowbytes * BAND_HEIGHT);
+	if (band == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	for (y=0; y<d->height; y+=BAND_HEIGHT) {
+		nb = d->height - y < BAND_HEIGHT ? d->height - y : BAND_HEIGHT;
+		draw_rows_color(d, y, nb, band);
+		for (x=0; x<d->width * nb; x++) {
+			pix = &band[x * d->cbpp];
+			if (d->cbpp == 4 && pix[3] != 0xff) {
+				ci->opaque = 0;
+				if (pix[3] != 0x00)
+					ci->binary = 0;
+			}
+			else if ((pix[0] | pix[1] | pix[2]) == 0)
+				black = 1;
+			if (pix[0] != pix[1] || pix[1] != pix[2])
+				ci->gray = 0;
+			else if (ci->gray_depth < 8) {
+				depth = level_depth(pix[0]);
+				if (depth > ci->gray_depth)
+					ci->gray_depth = depth;
+			}
+			if (cap == 0 || pal->nb <= cap)
+				pal_add(pal, pal_pack(pix, d->cbpp));
+		}
+	}
+	free(band);
+
+	if (black)
+		ci->binary = 0;
+}
+
+/* choose the output format of the image from <ci>: the one with the
+ * fewer bits per pixel. With <colors>, a palette is forced.
+ */
+void choose_format(struct draw *d, struct palette *pal, struct colorinfo *ci,
+                   int colors)
+{
+	int best_bits;
+	int bits;
+
+	/* palette depth */
+	if (colors || pal->nb <= 256) {
+		pal_finish(pal, colors ? colors : 256);
+		bits = pal->nb_entries <= 2 ? 1 :
+		       pal->nb_entries <= 4 ? 2 :
+		       pal->nb_entries <= 16 ? 4 : 8;
+		if (colors) {
+			d->color_type = PNG_COLOR_TYPE_PALETTE;
+			d->depth = bits;
+			d->pal = pal;
+			return;
+		}
+	}
+	else
+		bits = 0;
+
+	/* the default one */
+	d->color_type = d->cbpp == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB;
+	d->depth = 8;
+	best_bits = d->cbpp * 8;
+
+	/* no alpha, or a color key */
+	if (d->cbpp == 4 && (ci->opaque || ci->binary)) {
+		d->color_type = PNG_COLOR_TYPE_RGB;
+		d->key = !ci->opaque;
+		best_bits = 24;
+	}
+
+	/* gray and alpha */
+	if (ci->gray && !ci->opaque && !ci->binary && 16 < best_bits) {
+		d->color_type = PNG_COLOR_TYPE_GRAY_ALPHA;
+		best_bits = 16;
+	}
+
+	/* palette, unless gray levels does the same without the PLTE chunk */
+	if (bits > 0 && bits < best_bits &&
+	    !(ci->gray && (ci->opaque || ci->binary) && ci->gray_depth <= bits)) {
+		d->color_type = PNG_COLOR_TYPE_PALETTE;
+		d->depth = bits;
+		d->key = 0;
+		d->pal = pal;
+		best_bits = bits;
+	}
+
+	/* gray levels */
+	if (ci->gray && (ci->opaque || ci->binary) && ci->gray_depth < best_bits) {
+		d->color_type = PNG_COLOR_TYPE_GRAY;
+		d->depth = ci->gray_depth;
+		d->key = !ci->opaque;
+		d->pal = NULL;
+		best_bits = ci->gray_depth;
+	}
+}
+
+/* build any rows [y0, y0+nb[ of the output image into <out>, in the
+ * output format. This is thread safe.
+ */
+void draw_rows(struct draw *d, int y0, int nb, png_bytep out)
+{
+	png_bytep rows;
+	png_bytep pix;
+	png_bytep row;
+	int pos;
+	int v;
+	int x;
+	int y;
+
+	if (d->color_type == (d->cbpp == 4 ? PNG_COLOR_TYPE_RGB_ALPHA : PNG_COLOR_TYPE_RGB)) {
+		draw_rows_color(d, y0, nb, out);
+		return;
+	}
+
+	rows = malloc((size_t)d->width * d->cbpp * nb);
+	if (rows == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	draw_rows_color(d, y0, nb, rows);
+
+	/* convert the colors */
+	memset(out, 0, d->rowbytes * nb);
+	for (y=0; y<nb; y++) {
+		row = out + d->rowbytes * y;
+		for (x=0; x<d->width; x++) {
+			pix = &rows[((size_t)y * d->width + x) * d->cbpp];
+			switch (d->color_type) {
+			case PNG_COLOR_TYPE_RGB:
+				row[x * 3] = pix[0];
+				row[x * 3 + 1] = pix[1];
+				row[x * 3 + 2] = pix[2];
+				continue;
+			case PNG_COLOR_TYPE_GRAY_ALPHA:
+				row[x * 2] = pix[0];
+				row[x * 2 + 1] = pix[3];
+				continue;
+			case PNG_COLOR_TYPE_GRAY:
+				v = pix[0] >> (8 - d->depth);
+				break;
+			default:
+				v = pal_lookup(d->pal, pal_pack(pix, d->cbpp))->index;
+				break;
+			}
+
+			/* pack the pixels, the first one in the high bits */
+			pos = x * d->depth;
+			row[pos >> 3] |= v << (8 - d->depth - (pos & 7));
+		}
+	}
+	free(rows);
+}
+
+/*
+ * Parallel encoder. The image data is cut in blocks of rows, and each
+ * block is filtered and deflated by a worker thread, like pigz does: the
+ * block is compressed as a raw deflate stream, primed with the last 32KB
+ * of the previous block as dictionary, and ends with a sync flush so the
+ * blocks can be concatenated. The last one ends the deflate stream. The
+ * zlib header and the adler32 of the whole data are added around them.
+ *
+ * The blocks size only depends on the image width, so the output does
+ * not depend on the number of threads.
+ *
+ * The same encoder is used by the -O search: each candidate set of
+ * parameters is a full encoding, and the tasks of all the candidates are
+ * run together.
+ */
+#define ENC_BLOCK (1024 * 1024)    /* filtered bytes per block */
+#define ENC_WINDOW 32768           /* deflate window */
+#define ENC_SAMPLES 4              /* blocks encoded to rank the candidates */
+
+/* row filters. FILTER_ADAPTIVE chooses the filter of each row, the other
+ * ones are the png filter type + 1.
+ */
+#define FILTER_ADAPTIVE 0
+#define FILTER_NONE     1
+#define FILTER_SUB      2
+#define FILTER_UP       3
+#define FILTER_AVG      4
+#define FILTER_PAETH    5
+
+static const char *filter_names[] = { "adaptive", "none", "sub", "up", "avg", "paeth" };
+
+struct enc_param {
+	int filter;
+	int level;
+	int strategy;
+	int wbits;
+};
+
+/* the libpng defaults for the format of <d>, always the first candidate:
+ * no filter and the default strategy for the palette images and the
+ * depths below 8 bits, adaptive filters and Z_FILTERED for the others.
+ */
+void enc_default(struct draw *d, struct enc_param *par)
+{
+	if (d->color_type == PNG_COLOR_TYPE_PALETTE || d->depth < 8) {
+		par->filter = FILTER_NONE;
+		par->strategy = Z_DEFAULT_STRATEGY;
+	}
+	else {
+		par->filter = FILTER_ADAPTIVE;
+		par->strategy = Z_FILTERED;
+	}
+	par->level = Z_DEFAULT_COMPRESSION;
+	par->wbits = 15;
+}
+
+struct enc_block {
+	unsigned char *out;
+	size_t len;
+	uLong adler;
+	size_t raw;
+};
+
+struct enc_job {
+	struct draw *draw;
+	int rows;                  /* rows per block */
+	int nb_blocks;             /* blocks of the image */
+	struct enc_param *params;
+	int nb_params;
+	int *sel;                  /* blocks encoded for each candidate */
+	int nb_sel;
+	struct enc_block *blocks;  /* nb_params * nb_sel */
+};
+
+static inline
+int paeth(int a, int b, int c)
+{
+	int p = a + b - c;
+	int pa = abs(p - a);
+	int pb = abs(p - b);
+	int pc = abs(p - c);
+
+	if (pa <= pb && pa <= pc)
+		return a;
+	if (pb <= pc)
+		return b;
+	return c;
+}
+
+/* filter the row <row> (with <prev> the previous row, or NULL) into <out>
+ * (the filter type byte followed by the filtered row). With
+ * FILTER_ADAPTIVE, the filter is chosen with the heuristic used by
+ * libpng: the one which gives the lowest sum of absolute values of the
+ * filtered bytes.
+ */
+void filter_row(png_bytep row, png_bytep prev, size_t rowbytes, int bpp,
+                png_bytep out, png_bytep tmp, int filter)
+{
+	unsigned long sum;
+	unsigned long best_sum = ~0UL;
+	int best = 0;
+	int f;
+	int fs;
+	int fe;
+	size_t i;
+	int a;
+	int b;
+	int c;
+	unsigned char v;
+
+	if (filter == FILTER_ADAPTIVE) {
+		fs = 0;
+		fe = 5;
+	}
+	else {
+		fs = filter - 1;
+		fe = filter;
+	}
+
+	for (f=fs; f<fe; f++) {
+		sum = 0;
+		for (i=0; i<rowbytes; i++) {
+			a = i >= bpp ? row[i - bpp] : 0;
+			b = prev ? prev[i] : 0;
+			c = prev && i >= bpp ? prev[i - bpp] : 0;
+			switch (f) {
+			case 0: v = row[i]; break;
+			case 1: v = row[i] - a; break;
+			case 2: v = row[i] - b; break;
+			case 3: v = row[i] - ((a + b) >> 1); break;
+			default: v = row[i] - paeth(a, b, c); break;
+			}
+			tmp[i] = v;
+			sum += v < 128 ? v : 256 - v;
+		}
+		if (sum < best_sum) {
+			best_sum = sum;
+			best = f;
+			memcpy(out + 1, tmp, rowbytes);
+		}
+	}
+	out[0] = best;
+}
+
+static
+void enc_task(void *arg, int t)
+{
+	struct enc_job *job = arg;
+	struct enc_param *par = &job->params[t / job->nb_sel];
+	struct enc_block *blk = &job->blocks[t];
+	int k = job->sel[t % job->nb_sel];
+	size_t rowbytes = job->draw->rowbytes;
+	size_t fbytes = rowbytes + 1;
+	unsigned char *raw;
+	unsigned char *filt;
+	unsigned char *tmp;
+	unsigned char *out;
+	z_stream zs;
+	double start;
+	int dict_rows;
+	int first;
+	int rows;
+	int y0;
+	int nb;
+	int y;
+	int ret;
+	int flush;
+
+	start = stats_now();
+
+	/* rows of the block */
+	y0 = k * job->rows;
+	nb = job->draw->height - y0 < job->rows ? job->draw->height - y0 : job->rows;
+	rows = nb;
+
+	/* the previous rows are needed for the dictionary, and one more for
+	 * the filter of the first of them.
+	 */
+	dict_rows = k == 0 ? 0 : (ENC_WINDOW + fbytes - 1) / fbytes;
+	if (dict_rows > y0)
+		dict_rows = y0;
+	first = y0 - dict_rows;
+	if (first > 0)
+		first--;
+	nb += y0 - first;
+
+	raw = malloc(rowbytes * nb);
+	filt = malloc(fbytes * nb);
+	tmp = malloc(rowbytes);
+	if (raw == NULL || filt == NULL || tmp == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	draw_rows(job->draw, first, nb, raw);
+	for (y=0; y<nb; y++)
+		filter_row(raw + rowbytes * y, first + y > 0 && y > 0 ? raw + rowbytes * (y - 1) : NULL,
+		           rowbytes, job->draw->bpp, filt + fbytes * y, tmp, par->filter);
+	free(raw);
+	free(tmp);
+
+	/* compress the rows of the block, primed with the previous ones */
+	memset(&zs, 0, sizeof(zs));
+	if (deflateInit2(&zs, par->level, Z_DEFLATED, -par->wbits, 8, par->strategy) != Z_OK) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	y = y0 - first;
+	if (k > 0) {
+		size_t dlen = fbytes * y;
+		unsigned char *dict = filt;
+
+		if (dlen > (1 << par->wbits)) {
+			dict += dlen - (1 << par->wbits);
+			dlen = 1 << par->wbits;
+		}
+		deflateSetDictionary(&zs, dict, dlen);
+	}
+
+	blk->raw = fbytes * (nb - y);
+	blk->adler = adler32(adler32(0L, Z_NULL, 0), filt + fbytes * y, blk->raw);
+	blk->len = deflateBound(&zs, blk->raw) + 16;
+	blk->out = malloc(blk->len);
+	if (blk->out == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	zs.next_in = filt + fbytes * y;
+	zs.avail_in = blk->raw;
+	zs.next_out = blk->out;
+	zs.avail_out = blk->len;
+
+	/* until all the rows are consumed and flushed, or the stream is
+	 * finished for the last block. If the bound was short, the buffer
+	 * grows.
+	 */
+	flush = k == job->nb_blocks - 1 ? Z_FINISH : Z_SYNC_FLUSH;
+	while (1) {
+		ret = deflate(&zs, flush);
+		if (ret != Z_OK && ret != Z_STREAM_END) {
+			fprintf(stderr, "deflate error %d\n", ret);
+			exit(1);
+		}
+		if (flush == Z_FINISH ? ret == Z_STREAM_END :
+		    zs.avail_in == 0 && zs.avail_out > 0)
+			break;
+		if (zs.avail_out > 0)
+			continue;
+		blk->len *= 2;
+		blk->out = realloc(blk->out, blk->len);
+		if (blk->out == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		zs.next_out = blk->out + zs.total_out;
+		zs.avail_out = blk->len - zs.total_out;
+	}
+	blk->len = zs.total_out;
+	deflateEnd(&zs);
+	free(filt);
+
+	/* the buffer was sized for the worst case */
+	out = realloc(blk->out, blk->len);
+	if (out != NULL)
+		blk->out = out;
+	trace_span("encode", start, NULL, "y", y0, "rows", rows);
+}
+
+/* encode the blocks <sel> of the image for each candidate of <params>.
+ * returns the blocks, nb_params * nb_sel.
+ */
+struct enc_block *enc_run(struct enc_job *job, struct enc_param *params,
+                          int nb_params, int *sel, int nb_sel, int threads)
+{
+	job->params = params;
+	job->nb_params = nb_params;
+	job->sel = sel;
+	job->nb_sel = nb_sel;
+	job->blocks = calloc(sizeof(struct enc_block), nb_params * nb_sel);
+	if (job->blocks == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	workpool_run(threads, nb_params * nb_sel, enc_task, job);
+	return job->blocks;
+}
+
+/* size of the encoding of the candidate <p> */
+size_t enc_size(struct enc_job *job, struct enc_block *blocks, int p)
+{
+	size_t size = 2 + 4; /* zlib header and adler32 */
+	int k;
+
+	for (k=0; k<job->nb_sel; k++)
+		size += blocks[p * job->nb_sel + k].len;
+	return size;
+}
+
+void enc_free(struct enc_block *blocks, int nb)
+{
+	int i;
+
+	for (i=0; i<nb; i++)
+		free(blocks[i].out);
+	free(blocks);
+}
+
+/* the candidates tried by -O, the default one <def> first. Level 1 and 2
+ * try the usual winners, level 3 tries all the combinations.
+ */
+int enc_candidates(int optimize, const struct enc_param *def, struct enc_param **ret)
+{
+	static const int strategies[] = { Z_DEFAULT_STRATEGY, Z_FILTERED, Z_RLE };
+	static const int levels[] = { 9, 6 };
+	static const int wbits[] = { 15, 12 };
+	struct enc_param *params;
+	int nb = 1;
+	int f;
+	int s;
+	int l;
+	int w;
+
+	params = malloc(sizeof(*params) * (1 + 6 * 3 * 2 * 2));
+	if (params == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	params[0] = *def;
+
+	for (w=0; w<2; w++) {
+		for (l=0; l<2; l++) {
+			for (f=FILTER_ADAPTIVE; f<=FILTER_PAETH; f++) {
+				for (s=0; s<3; s++) {
+					if (optimize < 3 &&
+					    (w > 0 || l > 0 ||
+					     (f != FILTER_ADAPTIVE && f != FILTER_NONE &&
+					      f != FILTER_UP && f != FILTER_PAETH)))
+						continue;
+					params[nb].filter = f;
+					params[nb].level = levels[l];
+					params[nb].strategy = strategies[s];
+					params[nb].wbits = wbits[w];
+					nb++;
+				}
+			}
+		}
+	}
+
+	*ret = params;
+	return nb;
+}
+
+void enc_report(struct enc_param *par, size_t size, int sample, int best)
+{
+	fprintf(stderr, "%c filter %-8s level %d strategy %-8s window %2d: %lu bytes%s\n",
+	        best ? '*' : ' ',
+	        filter_names[par->filter],
+	        par->level == Z_DEFAULT_COMPRESSION ? 6 : par->level,
+	        par->strategy == Z_FILTERED ? "filtered" :
+	        par->strategy == Z_RLE ? "rle" : "default",
+	        par->wbits, (unsigned long)size,
+	        sample ? " (sample)" : "");
+}
+
+/* write the image data as IDAT chunks, compressed by <threads> threads.
+ * With <optimize>, the candidates of enc_candidates() are tried, and the
+ * smallest encoding is written. At level 1, the candidates are ranked on
+ * a sample of the blocks, and only the best one and the default one are
+ * fully encoded.
+ */
+void write_idat_parallel(png_structp png_ptr, struct draw *d, int threads,
+                         int optimize)
+{
+	struct enc_job job;
+	struct enc_param *params;
+	struct enc_param def;
+	struct enc_param full[2];
+	struct enc_block *blocks;
+	struct enc_block *blk;
+	size_t rowbytes = d->rowbytes;
+	unsigned char hdr[2];
+	unsigned char trailer[4];
+	size_t *sizes;
+	size_t size;
+	size_t best_size;
+	uLong adler;
+	int *sel;
+	int nb_params;
+	int best;
+	int level;
+	int flevel;
+	int batch;
+	int nb;
+	int i;
+	int p;
+	int k;
+
+	/* rows per block */
+	job.draw = d;
+	job.rows = ENC_BLOCK / (rowbytes + 1);
+	if (job.rows < 1)
+		job.rows = 1;
+	job.nb_blocks = (d->height + job.rows - 1) / job.rows;
+
+	sel = malloc(sizeof(int) * job.nb_blocks);
+	if (sel == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	enc_default(d, &def);
+	if (!optimize) {
+		params = &def;
+		nb_params = 1;
+	}
+	else
+		nb_params = enc_candidates(optimize, &def, &params);
+
+	/* level 1: rank the candidates on a few blocks spread on the image,
+	 * then keep the best one and the default one.
+	 */
+	if (optimize == 1 && job.nb_blocks > ENC_SAMPLES) {
+		for (k=0; k<ENC_SAMPLES; k++)
+			sel[k] = k * (job.nb_blocks - 1) / (ENC_SAMPLES - 1);
+		blocks = enc_run(&job, params, nb_params, sel, ENC_SAMPLES, threads);
+		best = 0;
+		best_size = 0;
+		for (p=0; p<nb_params; p++) {
+			size = enc_size(&job, blocks, p);
+			if (p == 0 || size < best_size) {
+				best = p;
+				best_size = size;
+			}
+		}
+		for (p=0; p<nb_params; p++)
+			enc_report(&params[p], enc_size(&job, blocks, p), 1, p == best);
+		enc_free(blocks, nb_params * ENC_SAMPLES);
+		full[0] = params[0];
+		full[1] = params[best];
+		free(params);
+		params = full;
+		nb_params = best == 0 ? 1 : 2;
+	}
+
+	/* full encoding of the candidates. They are encoded a few at a time,
+	 * just enough to keep the threads busy, and only the blocks of the
+	 * best one are kept: the other ones are freed once beaten.
+	 */
+	for (k=0; k<job.nb_blocks; k++)
+		sel[k] = k;
+	sizes = malloc(sizeof(size_t) * nb_params);
+	blocks = calloc(sizeof(struct enc_block), job.nb_blocks);
+	if (sizes == NULL || blocks == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	batch = threads / job.nb_blocks;
+	if (batch < 1)
+		batch = 1;
+	best = 0;
+	best_size = 0;
+	for (p=0; p<nb_params; p+=nb) {
+		nb = nb_params - p < batch ? nb_params - p : batch;
+		blk = enc_run(&job, params + p, nb, sel, job.nb_blocks, threads);
+		for (i=0; i<nb; i++) {
+			sizes[p + i] = enc_size(&job, blk, i);
+			if (p + i == 0 || sizes[p + i] < best_size) {
+				best = p + i;
+				best_size = sizes[p + i];
+				for (k=0; k<job.nb_blocks; k++) {
+					free(blocks[k].out);
+					blocks[k] = blk[i * job.nb_blocks + k];
+				}
+			}
+			else {
+				for (k=0; k<job.nb_blocks; k++)
+					free(blk[i * job.nb_blocks + k].out);
+			}
+		}
+		free(blk);
+	}
+	if (optimize) {
+		for (p=0; p<nb_params; p++)
+			enc_report(&params[p], sizes[p], 0, p == best);
+	}
+	free(sizes);
+
+	/* zlib header, with the window size and the compression level */
+	level = params[best].level == Z_DEFAULT_COMPRESSION ? 6 : params[best].level;
+	if (params[best].strategy >= Z_HUFFMAN_ONLY || level < 2)
+		flevel = 0;
+	else if (level < 6)
+		flevel = 1;
+	else if (level == 6)
+		flevel = 2;
+	else
+		flevel = 3;
+	hdr[0] = ((params[best].wbits - 8) << 4) | Z_DEFLATED;
+	hdr[1] = flevel << 6;
+	hdr[1] += 31 - (hdr[0] * 256 + hdr[1]) % 31;
+
+	/* zlib header, blocks, then the adler32 of the whole data */
+	png_write_chunk(png_ptr, (png_const_bytep)"IDAT", hdr, 2);
+	adler = adler32(0L, Z_NULL, 0);
+	for (k=0; k<job.nb_blocks; k++) {
+		png_write_chunk(png_ptr, (png_const_bytep)"IDAT",
+		                blocks[k].out, blocks[k].len);
+		adler = adler32_combine(adler, blocks[k].adler, blocks[k].raw);
+	}
+	trailer[0] = adler >> 24;
+	trailer[1] = adler >> 16;
+	trailer[2] = adler >> 8;
+	trailer[3] = adler;
+	png_write_chunk(png_ptr, (png_const_bytep)"IDAT", trailer, 4);
+
+	enc_free(blocks, job.nb_blocks);
+	if (optimize && params != full)
+		free(params);
+	free(sel);
+}
+
+/* prepare the building of the rows of the output image. If the surface
+ * has no pixels (streaming mode) the rows are built from the input images
+ * <pool>, using an index of the images covering each band of rows, so the
+ * full canvas is never needed.
+ */
+void draw_init(struct draw *d, struct surface *surf, struct node **pool, int nb_img,
+               int height, int qual, struct color *alpha)
+{
+	d->surf = surf;
+	d->width = surf->width;
+	d->height = height;
+	d->cbpp = alpha ? 3 : 4;
+	d->qual = qual;
+	d->alpha = alpha;
+	d->conv = conv_select(alpha != NULL);
+	d->cv.mask = color_mask[qual];
+	if (alpha != NULL)
+		d->cv.bg = *alpha;
+	d->key = 0;
+	d->pal = NULL;
+
+	/* index the images by band of rows */
+	if (surf->pixels == NULL)
+		band_index_build(&d->bi, pool, nb_img, height);
+}
+
+void draw_free(struct draw *d)
+{
+	if (d->surf->pixels == NULL)
+		band_index_free(&d->bi);
+	if (d->pal != NULL)
+		pal_free(d->pal);
+}
+
+struct hash_job {
+	struct draw *d;
+	uint64_t *bands;
+};
+
+static
+void hash_task(void *arg, int b)
+{
+	struct hash_job *job = arg;
+	struct draw *d = job->d;
+	size_t rowbytes = (size_t)d->width * d->cbpp;
+	png_bytep rows;
+	double start;
+	int y;
+	int nb;
+
+	start = stats_now();
+	y = b * BAND_HEIGHT;
+	nb = d->height - y < BAND_HEIGHT ? d->height - y : BAND_HEIGHT;
+	rows = malloc(rowbytes * nb);
+	if (rows == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	draw_rows_color(d, y, nb, rows);
+	job->bands[b] = xxh64(rows, rowbytes * nb, b);
+	free(rows);
+	trace_span("hash", start, NULL, "y", y, "rows", nb);
+}
+
+/* hash of the pixels of the output image, as they are converted for the
+ * encoding, and of the words <extra> (the size and the options which
+ * change the file). The bands of rows are hashed in parallel with xxh64,
+ * then the list of their hashes, so the result does not depend on
+ * <threads>. The words and the hashes are hashed in little endian, so
+ * the result does not depend on the host either. The 64 bits are folded
+ * to the 32 bits of the name hash.
+ */
+uint32_t draw_hash(struct draw *d, int threads, const uint32_t *extra, int nb_extra)
+{
+	struct hash_job job;
+	unsigned char *le;
+	uint64_t h;
+	int nb;
+	int i;
+	int k;
+
+	nb = (d->height + BAND_HEIGHT - 1) / BAND_HEIGHT;
+	job.d = d;
+	job.bands = malloc(sizeof(uint64_t) * (nb + 1));
+	le = malloc(8 * (nb + 1) + 4 * nb_extra);
+	if (job.bands == NULL || le == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	workpool_run(threads, nb, hash_task, &job);
+
+	for (i=0; i<nb_extra; i++)
+		for (k=0; k<4; k++)
+			le[i * 4 + k] = extra[i] >> (k * 8);
+	job.bands[nb] = xxh64(le, 4 * nb_extra, 0);
+	for (i=0; i<=nb; i++)
+		for (k=0; k<8; k++)
+			le[i * 8 + k] = job.bands[i] >> (k * 8);
+	h = xxh64(le, 8 * (nb + 1), 0);
+	free(job.bands);
+	free(le);
+	return h ^ (h >> 32);
+}
+
+/* write the output image, from the rows of <d>. With more than one
+ * thread or with <optimize>, a non interlaced image is compressed by
+ * write_idat_parallel(). The smallest lossless format is written, or
+ * with <colors> a palette of at most <colors> entries.
+ */
+void drawpng(struct draw *d, int interlace, const char *name,
+             int threads, int optimize, int colors, struct outbuf *mem)
+{
+	int width = d->width;
+	int height = d->height;
+	png_color plte[256];
+	png_byte trns[256];
+	png_color_16 key;
+	struct palette *pal;
+	struct colorinfo ci;
+	int channels;
+	FILE *fp;
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_bytep band;
+	size_t rowbytes;
+	double start;
+	int nb;
+	int y;
+	int i;
+	int passes;
+	int once;
+	int n;
+
+	/* Open file for writing (binary mode), or a memory stream */
+	if (mem != NULL)
+		fp = open_memstream(&mem->buf, &mem->len);
+	else
+		fp = fopen(name, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "Could not open file %s for writing\n", name);
+		exit(1);
+	}
+
+	/* Initialize write structure */
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	if (png_ptr == NULL) {
+		fprintf(stderr, "Could not allocate write struct\n");
+		exit(1);
+	}
+
+	/* Initialize info structure */
+	info_ptr = png_create_info_struct(png_ptr);
+	if (info_ptr == NULL) {
+		fprintf(stderr, "Could not allocate info struct\n");
+		exit(1);
+	}
+
+	/* Setup Exception handling */
+	if (setjmp(png_jmpbuf(png_ptr))) {
+		fprintf(stderr, "Error during png creation\n");
+		exit(1);
+	}
+
+	png_init_io(png_ptr, fp);
+
+	/* smallest lossless format, or the palette of the image */
+	pal = pal_new();
+	color_scan(d, pal, colors ? 0 : 256, &ci);
+	choose_format(d, pal, &ci, colors);
+	if (d->pal == NULL)
+		pal_free(pal);
+	channels = d->color_type == PNG_COLOR_TYPE_RGB_ALPHA ? 4 :
+	           d->color_type == PNG_COLOR_TYPE_RGB ? 3 :
+	           d->color_type == PNG_COLOR_TYPE_GRAY_ALPHA ? 2 : 1;
+	d->bpp = (channels * d->depth + 7) / 8;
+	d->rowbytes = ((size_t)width * channels * d->depth + 7) / 8;
+	rowbytes = d->rowbytes;
+
+	/* Write header */
+	png_set_IHDR(png_ptr, info_ptr, width, height,
+	             d->depth,
+	             d->color_type,
+	             interlace ?  PNG_INTERLACE_ADAM7 : PNG_INTERLACE_NONE, 
+	             PNG_COMPRESSION_TYPE_BASE,
+	             PNG_FILTER_TYPE_BASE);
+
+	/* palette and alpha of the entries */
+	if (d->pal != NULL) {
+		for (i=0; i<d->pal->nb_entries; i++) {
+			plte[i].red = d->pal->entries[i][0];
+			plte[i].green = d->pal->entries[i][1];
+			plte[i].blue = d->pal->entries[i][2];
+			trns[i] = d->pal->entries[i][3];
+		}
+		png_set_PLTE(png_ptr, info_ptr, plte, d->pal->nb_entries);
+		if (d->pal->nb_trans > 0)
+			png_set_tRNS(png_ptr, info_ptr, trns, d->pal->nb_trans, NULL);
+	}
+
+	/* the unused pixels are black, this is the transparent color */
+	if (d->key) {
+		memset(&key, 0, sizeof(key));
+		png_set_tRNS(png_ptr, info_ptr, NULL, 0, &key);
+	}
+
+	/* write png info into file */
+	png_write_info(png_ptr, info_ptr);
+
+	/* parallel compression, the end of the file is written by hand
+	 * because libpng did not see the image data. It is also used by -O.
+	 */
+	if ((threads > 1 || optimize) && !interlace && height > 0) {
+		write_idat_parallel(png_ptr, d, threads, optimize);
+		png_write_chunk(png_ptr, (png_const_bytep)"IEND", NULL, 0);
+		png_destroy_write_struct(&png_ptr, &info_ptr);
+		fclose(fp);
+		return;
+	}
+
+	/* number of passes */
+	if (interlace)
+		passes = png_set_interlace_handling(png_ptr);
+	else
+		passes = 1;
+
+	/* Allocate memory for one band. The interlaced passes use all the
+	 * rows, so they are converted once, unless the canvas is not
+	 * allocated (streaming mode): then each pass builds them again.
+	 */
+	once = passes > 1 && d->surf->pixels != NULL;
+	band = malloc(rowbytes * (once ? height : BAND_HEIGHT));
+	if (band == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	if (once) {
+		for (y=0 ; y<height ; y+=BAND_HEIGHT) {
+			nb = height - y < BAND_HEIGHT ? height - y : BAND_HEIGHT;
+			draw_rows(d, y, nb, band + rowbytes * y);
+		}
+	}
+
+	/* Write image data */
+	for(n=0; n<passes; n++) {
+		if (once) {
+			for (y=0 ; y<height ; y++)
+				png_write_row(png_ptr, band + rowbytes * y);
+			continue;
+		}
+		for (y=0 ; y<height ; y+=BAND_HEIGHT) {
+			start = stats_now();
+			nb = height - y < BAND_HEIGHT ? height - y : BAND_HEIGHT;
+			draw_rows(d, y, nb, band);
+			for (i=0; i<nb; i++)
+				png_write_row(png_ptr, band + rowbytes * i);
+			trace_span("encode", start, NULL, "y", y, "rows", nb);
+		}
+	}
+
+	/* End write */
+	png_write_end(png_ptr, NULL);
+	fclose(fp);
+	png_free_data(png_ptr, info_ptr, PNG_FREE_ALL, -1);
+	png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
+	free(band);
+}
+
+/* read the file <in_file>. returns NULL with a message if it cannot be
+ * read.
+ */
+char *read_file(const char *in_file)
+{
+	struct stat buf;
+	int fd;
+	char *bloc;
+
+	/* get size */
+	if (stat(in_file, &buf) < 0) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n",
+		        in_file, strerror(errno));
+		return NULL;
+	}
+
+	/* open input template file */
+	fd = open(in_file, O_RDONLY);
+	if (fd < 0) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n",
+		        in_file, strerror(errno));
+		return NULL;
+	}
+
+	/* memory for data */
+	bloc = malloc(buf.st_size + 1);
+	if (bloc == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	/* load data */
+	if (read(fd, bloc, buf.st_size) != buf.st_size) {
+		fprintf(stderr, "cannot read file \"%s\": %s\n",
+		        in_file, strerror(errno));
+		free(bloc);
+		close(fd);
+		return NULL;
+	}
+	bloc[buf.st_size] = '\0';
+
+	/* close inpout template file */
+	close(fd);
+
+	return bloc;
+}
+
+char *load_file(const char *in_file)
+{
+	char *bloc;
+
+	bloc = read_file(in_file);
+	if (bloc == NULL)
+		exit(1);
+	return bloc;
+}
+
+/* the inputs <inputs> followed by the names of the file <list>, one per
+ * line. <nb> is updated.
+ */
+char **load_list(const char *list, char **inputs, int *nb)
+{
+	char **all;
+	char *bloc;
+	char *p;
+	int lines = 0;
+	int n;
+
+	bloc = load_file(list);
+	for (p = bloc; *p != '\0'; p++)
+		if (*p == '\n')
+			lines++;
+
+	all = malloc(sizeof(char *) * (*nb + lines + 2));
+	if (all == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	memcpy(all, inputs, sizeof(char *) * *nb);
+	n = *nb;
+
+	for (p = strtok(bloc, "\r\n"); p != NULL; p = strtok(NULL, "\r\n"))
+		all[n++] = p;
+	*nb = n;
+	return all;
+}
+
+/* compile the template <bloc> in one pass: the text is copied until a
+ * "$(" which starts a known variable.
+ */
+unsigned char *parse_tpl(const char *bloc)
+{
+	const struct tpl_var *v;
+	unsigned char *code;
+	const char *text;
+	const char *p;
+	const char *end;
+	uint32_t len;
+	size_t pos = 0;
+
+	/* the code is never bigger than the template and 5 bytes by text */
+	code = malloc(strlen(bloc) * 6 + 6);
+	if (code == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	text = bloc;
+	for (p = bloc; *p != '\0'; p++) {
+		if (p[0] != '$' || p[1] != '(')
+			continue;
+
+		/* look for the variable name */
+		end = strchr(p + 2, ')');
+		if (end == NULL)
+			break;
+		for (v = tpl_vars; v->name != NULL; v++)
+			if (strlen(v->name) == end - p - 2 &&
+			    memcmp(v->name, p + 2, end - p - 2) == 0)
+				break;
+		if (v->name == NULL)
+			continue;
+
+		/* text before the variable */
+		if (p != text) {
+			len = p - text;
+			code[pos++] = ELEM_STRING;
+			memcpy(&code[pos], &len, 4);
+			memcpy(&code[pos + 4], text, len);
+			pos += 4 + len;
+		}
+		code[pos++] = v->type;
+		text = end + 1;
+		p = end;
+	}
+
+	/* remaining text */
+	len = strlen(text);
+	if (len > 0) {
+		code[pos++] = ELEM_STRING;
+		memcpy(&code[pos], &len, 4);
+		memcpy(&code[pos + 4], text, len);
+		pos += 4 + len;
+	}
+	code[pos++] = ELEM_END;
+
+	return realloc(code, pos);
+}
+
+/* return true if one of the compiled parts of <tpl> uses <elem> */
+int tpl_uses(struct template *tpl, int elem)
+{
+	const unsigned char *pc;
+	uint32_t len;
+	int i;
+
+	for (i=0; i<3; i++) {
+		pc = tpl->code[i];
+		if (pc == NULL)
+			continue;
+		while (*pc != ELEM_END) {
+			if (*pc == elem)
+				return 1;
+			if (*pc++ == ELEM_STRING) {
+				memcpy(&len, pc, 4);
+				pc += 4 + len;
+			}
+		}
+	}
+	return 0;
+}
+
+struct template *load_tpl(const char *in_file, const char *hdr, const char *foot, const char *out_file)
+{
+	struct template *tpl;
+	char *bloc;
+
+	/* memory for the template */
+	tpl = calloc(sizeof(struct template), 1);
+	if (tpl == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	/* Load header file */
+	if (hdr) {
+		bloc = load_file(hdr);
+		tpl->code[0] = parse_tpl(bloc);
+	}
+
+	/* Load "each line" template */
+	bloc = load_file(in_file);
+	tpl->code[1] = parse_tpl(bloc);
+
+	/* Load footer file */
+	if (foot) {
+		bloc = load_file(foot);
+		tpl->code[2] = parse_tpl(bloc);
+	}
+	tpl->scaled = tpl_uses(tpl, ELEM_SCALE);
+
+	/* the output file is written by render_main() */
+	tpl->in_file = in_file;
+	tpl->hdr_file = hdr;
+	tpl->foot_file = foot;
+	tpl->out_file = out_file;
+
+	return tpl;
+}
+
+/* load again the files of the template <tpl>. If one of them cannot be
+ * read, the template keeps its previous version and -1 is returned.
+ */
+int reload_tpl(struct template *tpl)
+{
+	const char *files[3];
+	char *blocs[3] = { NULL, NULL, NULL };
+	int i;
+
+	files[0] = tpl->hdr_file;
+	files[1] = tpl->in_file;
+	files[2] = tpl->foot_file;
+	for (i=0; i<3; i++) {
+		if (files[i] == NULL)
+			continue;
+		blocs[i] = read_file(files[i]);
+		if (blocs[i] == NULL) {
+			fprintf(stderr, "keeping the previous version of \"%s\"\n", tpl->in_file);
+			while (i-- > 0)
+				free(blocs[i]);
+			return -1;
+		}
+	}
+
+	for (i=0; i<3; i++) {
+		if (files[i] == NULL)
+			continue;
+		free(tpl->code[i]);
+		tpl->code[i] = parse_tpl(blocs[i]);
+		free(blocs[i]);
+	}
+	tpl->scaled = tpl_uses(tpl, ELEM_SCALE);
+	return 0;
+}
+
+static inline
+void outbuf_add(struct outbuf *ob, const char *str, size_t len)
+{
+	if (ob->len + len > ob->size) {
+		ob->size = ob->size * 2 > ob->len + len ? ob->size * 2 : ob->len + len + 4096;
+		ob->buf = realloc(ob->buf, ob->size);
+		if (ob->buf == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	memcpy(ob->buf + ob->len, str, len);
+	ob->len += len;
+}
+
+/* decimal representation of <v> */
+static inline
+void outbuf_uint(struct outbuf *ob, unsigned long v)
+{
+	char tmp[24];
+	int i = sizeof(tmp);
+
+	do {
+		tmp[--i] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+	outbuf_add(ob, &tmp[i], sizeof(tmp) - i);
+}
+
+/* 8 digits hexadecimal representation of <v> */
+static inline
+void outbuf_hex8(struct outbuf *ob, unsigned int v)
+{
+	static const char digits[] = "0123456789abcdef";
+	char tmp[8];
+	int i;
+
+	for (i=7; i>=0; i--) {
+		tmp[i] = digits[v & 0xf];
+		v >>= 4;
+	}
+	outbuf_add(ob, tmp, 8);
+}
+
+/* write all the data of <buf> */
+void write_all(int fd, const char *name, const char *buf, size_t len)
+{
+	size_t done = 0;
+	ssize_t ret;
+
+	while (done < len) {
+		ret = write(fd, buf + done, len - done);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "cannot write file \"%s\": %s\n",
+			        name, strerror(errno));
+			exit(1);
+		}
+		done += ret;
+	}
+}
+
+/* render the part <idx> (0: header, 1: each image, 2: footer) of the
+ * template for one image into <ob>. The sizes and the offsets are in CSS
+ * pixels, the pixels of the input images divided by their density.
+ */
+void exec_tpl(struct template *tpl, int idx, struct outbuf *ob,
+              struct node *node, struct general *gen, int id)
+{
+	const unsigned char *pc = tpl->code[idx];
+	uint32_t len;
+
+	if (pc == NULL)
+		return;
+
+	/* the output image of the node */
+	gen += node->sheet;
+
+	while (1) {
+		switch(*pc++) {
+		case ELEM_STRING:
+			memcpy(&len, pc, 4);
+			outbuf_add(ob, (const char *)pc + 4, len);
+			pc += 4 + len;
+			break;
+		case ELEM_WIDTH:
+			outbuf_uint(ob, (node->width + gen->unit - 1) / gen->unit);
+			break;
+		case ELEM_HEIGHT:
+			outbuf_uint(ob, (node->height + gen->unit - 1) / gen->unit);
+			break;
+		case ELEM_OFFSETX:
+			outbuf_uint(ob, node->dest_x / gen->unit);
+			break;
+		case ELEM_OFFSETY:
+			outbuf_uint(ob, node->dest_y / gen->unit);
+			break;
+		case ELEM_NAME:
+			outbuf_add(ob, node->name, strlen(node->name));
+			break;
+		case ELEM_AZNAME:
+			outbuf_add(ob, node->azname, strlen(node->azname));
+			break;
+		case ELEM_HASH:
+			outbuf_hex8(ob, gen->hash);
+			break;
+		case ELEM_OUTPUT:
+			outbuf_add(ob, gen->output, strlen(gen->output));
+			break;
+		case ELEM_ID:
+			outbuf_uint(ob, id);
+			break;
+		case ELEM_SHEET:
+			outbuf_uint(ob, node->sheet);
+			break;
+		case ELEM_SCALE:
+			outbuf_uint(ob, gen->scale);
+			break;
+		case ELEM_SHEETWIDTH:
+			outbuf_uint(ob, gen->width);
+			break;
+		case ELEM_SHEETHEIGHT:
+			outbuf_uint(ob, gen->height);
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+/* render one chunk of one template, this runs in the worker threads. A
+ * template which uses $(scale) is rendered once by scale, from the
+ * smallest one, the other ones only for the smallest scale.
+ */
+static
+void render_task(void *arg, int task)
+{
+	struct tpl_render *r = arg;
+	struct template *tpl = r->tpls[task / r->nb_chunks / r->nb_scales];
+	struct outbuf *ob = &r->bufs[task];
+	int k = task % r->nb_chunks;
+	int s = task / r->nb_chunks % r->nb_scales;
+	struct general *gen;
+	struct node stnode;
+	double start;
+	int first;
+	int end;
+	int i;
+
+	/* the buffers of the other scales stay empty */
+	if (s > 0 && !tpl->scaled)
+		return;
+
+	start = stats_now();
+
+	/* the sheets of the scale, the biggest scale is the first */
+	gen = r->gen + (r->nb_scales - 1 - s) * r->nb_sheets;
+
+	/* header and footer */
+	if (k == 0 || k == r->nb_chunks - 1) {
+		stnode.width = 0;
+		stnode.height = 0;
+		stnode.dest_x = 0;
+		stnode.dest_y = 0;
+		stnode.name = "";
+		stnode.azname = "";
+		stnode.sheet = 0;
+		exec_tpl(tpl, k == 0 ? 0 : 2, ob, &stnode, gen, 0);
+		trace_span("template", start, tpl->out_file, "first", 0, "images", 0);
+		return;
+	}
+
+	/* images of the range, the span is recorded once they are rendered */
+	first = (k - 1) * TPL_CHUNK;
+	end = first + TPL_CHUNK < r->nb_img ? first + TPL_CHUNK : r->nb_img;
+	for (i=first; i<end; i++)
+		exec_tpl(tpl, 1, ob, r->pool[i], gen, i);
+	trace_span("template", start, tpl->out_file, "first", first, "images", end - first);
+}
+
+/* render all the templates, then write the files */
+static
+void *render_main(void *arg)
+{
+	struct tpl_render *r = arg;
+	struct outbuf *ob;
+	struct stats_clock start;
+	int fd;
+	int nb;
+	int t;
+	int k;
+
+	stats_start(&start);
+	nb = r->nb_scales * r->nb_chunks;
+	workpool_run(r->threads, r->nb_tpl * nb, render_task, r);
+
+	stats.tpl_bytes = 0;
+	for (k=0; k<r->nb_tpl * nb; k++)
+		stats.tpl_bytes += r->bufs[k].len;
+
+	/* one memory block per template */
+	if (r->mem != NULL) {
+		for (t=0; t<r->nb_tpl; t++) {
+			r->mem[t].len = 0;
+			for (k=0; k<nb; k++) {
+				ob = &r->bufs[t * nb + k];
+				if (ob->len > 0)
+					outbuf_add(&r->mem[t], ob->buf, ob->len);
+				free(ob->buf);
+			}
+		}
+		stats_end(&start, PHASE_TEMPLATES);
+		return NULL;
+	}
+
+	for (t=0; t<r->nb_tpl; t++) {
+		fd = open(r->tpls[t]->out_file, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+		if (fd < 0) {
+			fprintf(stderr, "cannot open file \"%s\": %s\n",
+			        r->tpls[t]->out_file, strerror(errno));
+			exit(1);
+		}
+		for (k=0; k<nb; k++) {
+			ob = &r->bufs[t * nb + k];
+			write_all(fd, r->tpls[t]->out_file, ob->buf, ob->len);
+			free(ob->buf);
+		}
+		close(fd);
+	}
+	stats_end(&start, PHASE_TEMPLATES);
+	return NULL;
+}
+
+/* render the templates <templates> for the images <pool>, into the files
+ * or into <mem> (one block per template) if it is not NULL. <gen> has the
+ * <nb_sheets> output images of each of the <nb_scales> scales. With more
+ * than one thread, the rendering runs in the background on one of them,
+ * <async> is set and tpl_render_wait() waits for the end.
+ */
+void tpl_render_start(struct tpl_render *r, struct template *templates,
+                      struct node **pool, int nb_img, struct general *gen,
+                      int nb_sheets, int nb_scales, int threads, struct outbuf *mem)
+{
+	struct template *tpl;
+
+	memset(r, 0, sizeof(*r));
+	for (tpl = templates; tpl != NULL; tpl = tpl->next)
+		r->nb_tpl++;
+	r->tpls = malloc(sizeof(struct template *) * (r->nb_tpl + 1));
+	if (r->tpls == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	r->nb_tpl = 0;
+	for (tpl = templates; tpl != NULL; tpl = tpl->next)
+		r->tpls[r->nb_tpl++] = tpl;
+
+	r->pool = pool;
+	r->nb_img = nb_img;
+	r->gen = gen;
+	r->nb_sheets = nb_sheets;
+	r->nb_scales = nb_scales;
+	r->threads = threads;
+	r->mem = mem;
+	r->nb_chunks = (nb_img + TPL_CHUNK - 1) / TPL_CHUNK + 2;
+	r->bufs = calloc(sizeof(struct outbuf), r->nb_tpl * nb_scales * r->nb_chunks + 1);
+	if (r->bufs == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	if (threads > 1 && r->nb_tpl > 0) {
+		r->threads = 1;
+		if (pthread_create(&r->tid, NULL, render_main, r) == 0) {
+			r->async = 1;
+			return;
+		}
+		r->threads = threads;
+	}
+	render_main(r);
+}
+
+void tpl_render_wait(struct tpl_render *r)
+{
+	if (r->async)
+		pthread_join(r->tid, NULL);
+	free(r->bufs);
+	free(r->tpls);
+}
+
+/*
+ * Build cache. The cache file keeps the fingerprint of each input file
+ * (size, modification time and content hash) with its cropped size and
+ * its place in the last layout, the fingerprints of the templates and of
+ * the generated files, a hash of the options and the image hash.
+ *
+ *   imgcssmap-cache 1
+ *   options <options hash>
+ *   crop <0 or 1>
+ *   width <output image width>
+ *   hash <image hash>
+ *   dep <size> <mtime sec> <mtime nsec> <content hash> <path>
+ *   output <size> <mtime sec> <mtime nsec> 0 <path>
+ *   input <size> <mtime sec> <mtime nsec> <content hash> <width> <height>
+ *         <crop x> <crop y> <dest x> <dest y> <path>
+ *
+ * If nothing changed, the outputs are kept as is. Otherwise, the size and
+ * the crop bounds of the unchanged inputs are reused if the crop option
+ * did not change, and with the stable layout the unchanged inputs keep
+ * their place.
+ */
+#define CACHE_MAGIC "imgcssmap-cache 1"
+
+struct fileinfo {
+	char *path;
+	long long size;
+	long long mtime_sec;
+	long mtime_nsec;
+	uint64_t hash;
+};
+
+struct cache_input {
+	struct fileinfo f;
+	int width;
+	int height;
+	int crop_x;
+	int crop_y;
+	int dest_x;
+	int dest_y;
+	int taken;      /* place already given to an image */
+};
+
+struct cache {
+	uint64_t options;
+	int crop;
+	int width;
+	unsigned int hash;
+	int nb_inputs;
+	struct cache_input *inputs;
+	struct cache_input **sorted;   /* inputs sorted by path */
+	int nb_deps;
+	struct fileinfo *deps;
+	int nb_outputs;
+	struct fileinfo *outputs;
+};
+
+/* 64 bits FNV-1a */
+static inline
+uint64_t fnv64(uint64_t h, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		h ^= p[i];
+		h *= 0x100000001b3ULL;
+	}
+	return h;
+}
+
+#define FNV64_INIT 0xcbf29ce484222325ULL
+
+/* fill <f> with the size and the modification date of <path>. Return -1
+ * if the file cannot be stat'ed.
+ */
+int file_stat(const char *path, struct fileinfo *f)
+{
+	struct stat st;
+
+	if (stat(path, &st) < 0)
+		return -1;
+	f->size = st.st_size;
+	f->mtime_sec = st.st_mtim.tv_sec;
+	f->mtime_nsec = st.st_mtim.tv_nsec;
+	return 0;
+}
+
+/* compute the content hash of <path> into <f>. Return -1 on error. */
+int file_hash(const char *path, struct fileinfo *f)
+{
+	char buf[65536];
+	uint64_t h = FNV64_INIT;
+	ssize_t len;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return -1;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
+		h = fnv64(h, buf, len);
+	close(fd);
+	if (len < 0)
+		return -1;
+	f->hash = h;
+	return 0;
+}
+
+/* check if the file <path> is the same as the cached one <c>, and fill
+ * <f> with its current fingerprint. The content is hashed only if the
+ * modification date changed.
+ */
+int file_match(const char *path, struct fileinfo *c, struct fileinfo *f)
+{
+	if (file_stat(path, f) < 0)
+		return 0;
+	if (c != NULL && f->size == c->size &&
+	    f->mtime_sec == c->mtime_sec && f->mtime_nsec == c->mtime_nsec) {
+		f->hash = c->hash;
+		return 1;
+	}
+	if (file_hash(path, f) < 0)
+		return 0;
+	return c != NULL && f->size == c->size && f->hash == c->hash;
+}
+
+static
+int cache_cmp(const void *a, const void *b)
+{
+	const struct cache_input * const *ca = a;
+	const struct cache_input * const *cb = b;
+
+	return strcmp((*ca)->f.path, (*cb)->f.path);
+}
+
+/* return the cached input <path> or NULL */
+struct cache_input *cache_lookup(struct cache *c, const char *path)
+{
+	struct cache_input key;
+	struct cache_input *pkey = &key;
+	struct cache_input **res;
+
+	if (c->nb_inputs == 0)
+		return NULL;
+	key.f.path = (char *)path;
+	res = bsearch(&pkey, c->sorted, c->nb_inputs, sizeof(*c->sorted), cache_cmp);
+	return res ? *res : NULL;
+}
+
+static
+void *cache_grow(void *array, int nb, size_t size)
+{
+	/* grow by power of 2 */
+	if ((nb & (nb - 1)) == 0) {
+		array = realloc(array, size * (nb ? nb * 2 : 1));
+		if (array == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	return array;
+}
+
+/* parse the fingerprint fields of a line, and return the position of
+ * the remaining fields, or NULL on error.
+ */
+static
+char *cache_parse_file(char *line, struct fileinfo *f)
+{
+	unsigned long long hash;
+	int len;
+
+	if (sscanf(line, "%lld %lld %ld %llx %n", &f->size, &f->mtime_sec,
+	           &f->mtime_nsec, &hash, &len) != 4)
+		return NULL;
+	f->hash = hash;
+	return line + len;
+}
+
+static
+char *cache_path(char *p)
+{
+	char *path;
+
+	p[strcspn(p, "\n")] = '\0';
+	path = strdup(p);
+	if (path == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	return path;
+}
+
+/* load the cache file. A missing or invalid cache is an empty cache */
+void cache_load(struct cache *c, const char *path)
+{
+	struct cache_input *in;
+	struct fileinfo *f;
+	unsigned long long opts;
+	char line[4096 + 256];
+	char *p;
+	FILE *fh;
+	int len;
+	int i;
+
+	memset(c, 0, sizeof(*c));
+
+	fh = fopen(path, "r");
+	if (fh == NULL)
+		return;
+
+	if (fgets(line, sizeof(line), fh) == NULL ||
+	    strncmp(line, CACHE_MAGIC "\n", strlen(CACHE_MAGIC) + 1) != 0) {
+		fclose(fh);
+		return;
+	}
+
+	while (fgets(line, sizeof(line), fh) != NULL) {
+
+		/**/ if (sscanf(line, "options %llx", &opts) == 1)
+			c->options = opts;
+
+		else if (sscanf(line, "crop %d", &c->crop) == 1)
+			;
+
+		else if (sscanf(line, "width %d", &c->width) == 1)
+			;
+
+		else if (sscanf(line, "hash %x", &c->hash) == 1)
+			;
+
+		else if (strncmp(line, "dep ", 4) == 0) {
+			c->deps = cache_grow(c->deps, c->nb_deps, sizeof(*c->deps));
+			f = &c->deps[c->nb_deps];
+			p = cache_parse_file(line + 4, f);
+			if (p == NULL)
+				goto invalid;
+			f->path = cache_path(p);
+			c->nb_deps++;
+		}
+
+		else if (strncmp(line, "output ", 7) == 0) {
+			c->outputs = cache_grow(c->outputs, c->nb_outputs, sizeof(*c->outputs));
+			f = &c->outputs[c->nb_outputs];
+			p = cache_parse_file(line + 7, f);
+			if (p == NULL)
+				goto invalid;
+			f->path = cache_path(p);
+			c->nb_outputs++;
+		}
+
+		else if (strncmp(line, "input ", 6) == 0) {
+			c->inputs = cache_grow(c->inputs, c->nb_inputs, sizeof(*c->inputs));
+			in = &c->inputs[c->nb_inputs];
+			memset(in, 0, sizeof(*in));
+			p = cache_parse_file(line + 6, &in->f);
+			if (p == NULL ||
+			    sscanf(p, "%d %d %d %d %d %d %n", &in->width, &in->height,
+			           &in->crop_x, &in->crop_y, &in->dest_x, &in->dest_y,
+			           &len) != 6)
+				goto invalid;
+			in->f.path = cache_path(p + len);
+			c->nb_inputs++;
+		}
+
+		else
+			goto invalid;
+	}
+	fclose(fh);
+
+	/* index the inputs by path */
+	c->sorted = malloc(sizeof(*c->sorted) * (c->nb_inputs + 1));
+	if (c->sorted == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i=0; i<c->nb_inputs; i++)
+		c->sorted[i] = &c->inputs[i];
+	qsort(c->sorted, c->nb_inputs, sizeof(*c->sorted), cache_cmp);
+	return;
+
+invalid:
+	fclose(fh);
+	fprintf(stderr, "invalid cache file \"%s\", ignored\n", path);
+	memset(c, 0, sizeof(*c));
+}
+
+void cache_free(struct cache *c)
+{
+	int i;
+
+	for (i=0; i<c->nb_deps; i++)
+		free(c->deps[i].path);
+	for (i=0; i<c->nb_outputs; i++)
+		free(c->outputs[i].path);
+	for (i=0; i<c->nb_inputs; i++)
+		free(c->inputs[i].f.path);
+	free(c->deps);
+	free(c->outputs);
+	free(c->inputs);
+	free(c->sorted);
+	memset(c, 0, sizeof(*c));
+}
+
+static
+void cache_write_file(FILE *fh, const char *type, struct fileinfo *f)
+{
+	fprintf(fh, "%s %lld %lld %ld %016llx %s\n", type, f->size, f->mtime_sec,
+	        f->mtime_nsec, (unsigned long long)f->hash, f->path);
+}
+
+/* write the cache file. The file is replaced atomically. */
+void cache_save(struct cache *c, const char *path)
+{
+	struct cache_input *in;
+	char *tmp;
+	FILE *fh;
+	int i;
+
+	tmp = malloc(strlen(path) + 5);
+	if (tmp == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	sprintf(tmp, "%s.tmp", path);
+
+	fh = fopen(tmp, "w");
+	if (fh == NULL) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n",
+		        tmp, strerror(errno));
+		exit(1);
+	}
+
+	fprintf(fh, CACHE_MAGIC "\n");
+	fprintf(fh, "options %016llx\n", (unsigned long long)c->options);
+	fprintf(fh, "crop %d\n", c->crop);
+	fprintf(fh, "width %d\n", c->width);
+	fprintf(fh, "hash %08x\n", c->hash);
+	for (i=0; i<c->nb_deps; i++)
+		cache_write_file(fh, "dep", &c->deps[i]);
+	for (i=0; i<c->nb_outputs; i++)
+		cache_write_file(fh, "output", &c->outputs[i]);
+	for (i=0; i<c->nb_inputs; i++) {
+		in = &c->inputs[i];
+		fprintf(fh, "input %lld %lld %ld %016llx %d %d %d %d %d %d %s\n",
+		        in->f.size, in->f.mtime_sec, in->f.mtime_nsec,
+		        (unsigned long long)in->f.hash, in->width, in->height,
+		        in->crop_x, in->crop_y, in->dest_x, in->dest_y, in->f.path);
+	}
+
+	if (fclose(fh) != 0 || rename(tmp, path) < 0) {
+		fprintf(stderr, "cannot write file \"%s\": %s\n",
+		        path, strerror(errno));
+		exit(1);
+	}
+	free(tmp);
+}
+
+/* return 1 if the cache <c> matches the current build: same options,
+ * same inputs in the same order with the same content, same templates
+ * and the generated files were not modified.
+ */
+int cache_uptodate(struct cache *c, uint64_t options, char **inputs, int nb_inputs,
+                   char **deps, int nb_deps)
+{
+	struct fileinfo f;
+	int i;
+
+	if (c->options != options ||
+	    c->nb_inputs != nb_inputs || c->nb_deps != nb_deps ||
+	    c->nb_outputs == 0)
+		return 0;
+
+	for (i=0; i<nb_deps; i++)
+		if (strcmp(c->deps[i].path, deps[i]) != 0 ||
+		    !file_match(deps[i], &c->deps[i], &f))
+			return 0;
+
+	for (i=0; i<nb_inputs; i++)
+		if (strcmp(c->inputs[i].f.path, inputs[i]) != 0 ||
+		    !file_match(inputs[i], &c->inputs[i].f, &f))
+			return 0;
+
+	/* the outputs must be unchanged since they were generated */
+	for (i=0; i<c->nb_outputs; i++) {
+		if (file_stat(c->outputs[i].path, &f) < 0 ||
+		    f.size != c->outputs[i].size ||
+		    f.mtime_sec != c->outputs[i].mtime_sec ||
+		    f.mtime_nsec != c->outputs[i].mtime_nsec)
+			return 0;
+	}
+
+	return 1;
+}
+
+/* place a node using the historical first-fit scan: the free space is
+ * scanned from left to right then from top to bottom, and the first
+ * position where the node fits is kept.
+ *
+ * The positions are visited in the same order than a pixel per pixel
+ * scan, but the occupancy bitmap allows to skip all the positions which
+ * are known to overlap a used pixel: if a row contains less free pixels
+ * than the node width, all the positions covering this row are skipped,
+ * and if a row overlaps a used pixel, all the positions on its left are
+ * skipped. So, the resulting placement is the same.
+ */
+int firstfit_place(struct surface *surf, int ymax, struct node *n)
+{
+	int larg = surf->width;
+	int x;
+	int y;
+	int r;
+	int c;
+	int conflict;
+
+	/* empty images always fit at the origin */
+	if (n->width == 0 || n->height == 0) {
+		n->dest_x = 0;
+		n->dest_y = 0;
+		return 1;
+	}
+
+	/* bigger than the surface */
+	if (n->width > larg || n->height > ymax)
+		return 0;
+
+	for (y=0; y<ymax-n->height+1; y++) {
+		x = 0;
+		while (x < larg-n->width+1) {
+			stats.probes++;
+			conflict = 0;
+			for (r=y; r<y+n->height; r++) {
+
+				/* the row cannot contain the node: skip all the
+				 * positions including this row.
+				 */
+				if (surf->free[r] < n->width) {
+					y = r;
+					goto next_line;
+				}
+
+				/* the left part of the row is used */
+				if (surf->lead[r] > x) {
+					x = surf->lead[r];
+					conflict = 1;
+					break;
+				}
+
+				/* the node overlaps some used pixels */
+				c = surface_last_used(surf, r, x, n->width);
+				if (c >= 0) {
+					x = c + 1;
+					conflict = 1;
+					break;
+				}
+			}
+			if (!conflict) {
+				n->dest_x = x;
+				n->dest_y = y;
+				return 1;
+			}
+		}
+next_line:
+		;
+	}
+	return 0;
+}
+
+/*
+ * Skyline packer. The top border of the used space is kept as a list of
+ * horizontal segments sorted by x and covering the whole width. A node
+ * is placed on the segment which gives the lowest top, then the leftmost
+ * position.
+ */
+struct skyline_seg {
+	int x;
+	int y;
+	int w;
+};
+
+struct skyline {
+	struct skyline_seg *segs;
+	struct skyline_seg *tmp;
+	int nb;
+	int larg;
+};
+
+void skyline_init(struct skyline *sk, int larg, int max)
+{
+	/* each placement adds at most two segments */
+	sk->segs = malloc(sizeof(struct skyline_seg) * (max * 2 + 1));
+	sk->tmp = malloc(sizeof(struct skyline_seg) * (max * 2 + 1));
+	if (sk->segs == NULL || sk->tmp == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	sk->segs[0].x = 0;
+	sk->segs[0].y = 0;
+	sk->segs[0].w = larg;
+	sk->nb = 1;
+	sk->larg = larg;
+}
+
+/* return the y where a node of width <w> lays if its left border is on
+ * the segment <i>, or -1 if it exceeds the right border.
+ */
+static inline
+int skyline_fit(struct skyline *sk, int i, int w)
+{
+	int x;
+	int y;
+	int rem;
+
+	x = sk->segs[i].x;
+	if (x + w > sk->larg)
+		return -1;
+
+	y = 0;
+	rem = w;
+	while (rem > 0) {
+		if (sk->segs[i].y > y)
+			y = sk->segs[i].y;
+		rem -= sk->segs[i].w;
+		i++;
+	}
+	return y;
+}
+
+int skyline_place(struct skyline *sk, int ymax, struct node *n)
+{
+	struct skyline_seg *s;
+	int best = -1;
+	int besty = 0;
+	int y;
+	int i;
+	int j;
+	int end;
+
+	/* search the lowest then leftmost position */
+	for (i=0; i<sk->nb; i++) {
+		stats.probes++;
+		y = skyline_fit(sk, i, n->width);
+		if (y < 0)
+			break;
+		if (best < 0 || y < besty) {
+			best = i;
+			besty = y;
+		}
+	}
+	if (best < 0 || besty + n->height > ymax)
+		return 0;
+
+	n->dest_x = sk->segs[best].x;
+	n->dest_y = besty;
+
+	/* nothing to update for empty images */
+	if (n->width == 0)
+		return 1;
+
+	/* find the segments covered by the node, the last one can be
+	 * partially covered.
+	 */
+	end = n->dest_x + n->width;
+	for (j=best; j<sk->nb && sk->segs[j].x + sk->segs[j].w <= end; j++);
+	if (j < sk->nb && sk->segs[j].x < end) {
+		sk->segs[j].w -= end - sk->segs[j].x;
+		sk->segs[j].x = end;
+	}
+
+	/* replace segments [best, j[ by the new one */
+	memmove(&sk->segs[best + 1], &sk->segs[j],
+	        sizeof(struct skyline_seg) * (sk->nb - j));
+	sk->nb -= j - best - 1;
+	s = &sk->segs[best];
+	s->x = n->dest_x;
+	s->y = besty + n->height;
+	s->w = n->width;
+
+	/* merge with neighbours at the same level */
+	if (best + 1 < sk->nb && sk->segs[best + 1].y == s->y) {
+		s->w += sk->segs[best + 1].w;
+		memmove(&sk->segs[best + 1], &sk->segs[best + 2],
+		        sizeof(struct skyline_seg) * (sk->nb - best - 2));
+		sk->nb--;
+	}
+	if (best > 0 && sk->segs[best - 1].y == s->y) {
+		sk->segs[best - 1].w += s->w;
+		memmove(&sk->segs[best], &sk->segs[best + 1],
+		        sizeof(struct skyline_seg) * (sk->nb - best - 1));
+		sk->nb--;
+	}
+
+	return 1;
+}
+
+static inline
+void skyline_push(struct skyline_seg *segs, int *nb, int x, int y, int w)
+{
+	if (w <= 0)
+		return;
+	if (*nb > 0 && segs[*nb - 1].y == y) {
+		segs[*nb - 1].w += w;
+		return;
+	}
+	segs[*nb].x = x;
+	segs[*nb].y = y;
+	segs[*nb].w = w;
+	(*nb)++;
+}
+
+/* raise the skyline to at least <top> on the columns [x, x+w[. This is
+ * used to take an already placed node into account, the free space
+ * below it is lost.
+ */
+void skyline_raise(struct skyline *sk, int x, int w, int top)
+{
+	struct skyline_seg *seg;
+	struct skyline_seg *swap;
+	int nb = 0;
+	int end;
+	int s;
+	int e;
+	int i;
+
+	for (i=0; i<sk->nb; i++) {
+		seg = &sk->segs[i];
+		end = seg->x + seg->w;
+
+		/* part on the left of the node */
+		s = seg->x;
+		e = end < x ? end : x;
+		skyline_push(sk->tmp, &nb, s, seg->y, e - s);
+
+		/* part under the node */
+		s = seg->x > x ? seg->x : x;
+		e = end < x + w ? end : x + w;
+		skyline_push(sk->tmp, &nb, s, seg->y > top ? seg->y : top, e - s);
+
+		/* part on the right of the node */
+		s = seg->x > x + w ? seg->x : x + w;
+		skyline_push(sk->tmp, &nb, s, seg->y, end - s);
+	}
+
+	swap = sk->segs;
+	sk->segs = sk->tmp;
+	sk->tmp = swap;
+	sk->nb = nb;
+}
+
+/*
+ * MaxRects packer. The free space is kept as a list of maximal free
+ * rectangles, which may overlap. A node is placed in the free rectangle
+ * which gives the lowest bottom border, then the leftmost position.
+ */
+struct rect {
+	int x;
+	int y;
+	int w;
+	int h;
+};
+
+struct maxrects {
+	struct rect *free;
+	int nb;
+	int size;
+};
+
+void maxrects_init(struct maxrects *mr, int larg, int height)
+{
+	mr->size = 64;
+	mr->free = malloc(sizeof(struct rect) * mr->size);
+	if (mr->free == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	mr->free[0].x = 0;
+	mr->free[0].y = 0;
+	mr->free[0].w = larg;
+	mr->free[0].h = height;
+	mr->nb = 1;
+}
+
+static inline
+void maxrects_add(struct maxrects *mr, int x, int y, int w, int h)
+{
+	if (w <= 0 || h <= 0)
+		return;
+	if (mr->nb >= mr->size) {
+		mr->size *= 2;
+		mr->free = realloc(mr->free, sizeof(struct rect) * mr->size);
+		if (mr->free == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	mr->free[mr->nb].x = x;
+	mr->free[mr->nb].y = y;
+	mr->free[mr->nb].w = w;
+	mr->free[mr->nb].h = h;
+	mr->nb++;
+}
+
+static inline
+int rect_contains(struct rect *a, struct rect *b)
+{
+	return b->x >= a->x && b->y >= a->y &&
+	       b->x + b->w <= a->x + a->w &&
+	       b->y + b->h <= a->y + a->h;
+}
+
+/* remove the area of the placed node <n> from the free rectangles */
+void maxrects_use(struct maxrects *mr, struct node *n)
+{
+	struct rect used;
+	struct rect f;
+	int old;
+	int i;
+	int j;
+	int nb;
+
+	/* nothing to update for empty images */
+	if (n->width == 0 || n->height == 0)
+		return;
+
+	used.x = n->dest_x;
+	used.y = n->dest_y;
+	used.w = n->width;
+	used.h = n->height;
+
+	/* split each free rectangle intersecting the used area. The
+	 * new rectangles are appended, so we only walk the original ones.
+	 */
+	nb = mr->nb;
+	for (i=0; i<nb; i++) {
+		f = mr->free[i];
+		if (used.x >= f.x + f.w || used.x + used.w <= f.x ||
+		    used.y >= f.y + f.h || used.y + used.h <= f.y)
+			continue;
+
+		maxrects_add(mr, f.x, f.y, f.w, used.y - f.y);
+		maxrects_add(mr, f.x, used.y + used.h, f.w, f.y + f.h - used.y - used.h);
+		maxrects_add(mr, f.x, f.y, used.x - f.x, f.h);
+		maxrects_add(mr, used.x + used.w, f.y, f.x + f.w - used.x - used.w, f.h);
+
+		/* mark the split rectangle as removed */
+		mr->free[i].w = 0;
+	}
+
+	/* remove the split rectangles, keeping the new ones after the others */
+	for (i=0, j=0; i<nb; i++)
+		if (mr->free[i].w != 0)
+			mr->free[j++] = mr->free[i];
+	old = j;
+	for (i=nb; i<mr->nb; i++)
+		mr->free[j++] = mr->free[i];
+	mr->nb = j;
+
+	/* remove the new rectangles contained in another. The old ones are
+	 * not contained in each other since the previous split, nor in a new
+	 * one, which is a part of a split one. So only the new ones are
+	 * compared to the list.
+	 */
+	for (i=old; i<mr->nb; i++) {
+		if (mr->free[i].w == 0)
+			continue;
+		for (j=0; j<old; j++)
+			if (rect_contains(&mr->free[j], &mr->free[i]))
+				break;
+		if (j < old) {
+			mr->free[i].w = 0;
+			continue;
+		}
+		for (j=i+1; j<mr->nb; j++) {
+			if (mr->free[j].w == 0)
+				continue;
+			if (rect_contains(&mr->free[j], &mr->free[i])) {
+				mr->free[i].w = 0;
+				break;
+			}
+			if (rect_contains(&mr->free[i], &mr->free[j]))
+				mr->free[j].w = 0;
+		}
+	}
+	for (i=0, j=0; i<mr->nb; i++)
+		if (mr->free[i].w != 0)
+			mr->free[j++] = mr->free[i];
+	mr->nb = j;
+}
+
+int maxrects_place(struct maxrects *mr, struct node *n)
+{
+	int best = -1;
+	int i;
+
+	/* search the free rectangle with the lowest then leftmost fit */
+	stats.probes += mr->nb;
+	for (i=0; i<mr->nb; i++) {
+		if (mr->free[i].w < n->width || mr->free[i].h < n->height)
+			continue;
+		if (best < 0 ||
+		    mr->free[i].y < mr->free[best].y ||
+		    (mr->free[i].y == mr->free[best].y &&
+		     mr->free[i].x < mr->free[best].x))
+			best = i;
+	}
+	if (best < 0)
+		return 0;
+
+	n->dest_x = mr->free[best].x;
+	n->dest_y = mr->free[best].y;
+
+	maxrects_use(mr, n);
+	return 1;
+}
+
+static inline
+void fill(struct surface *surf, int sx, int sy, struct node *n)
+{
+	int y;
+
+	if (surf->pixels != NULL && n->pixels != NULL) {
+		for (y=0; y<n->height; y++)
+			memcpy(&surf->pixels[(size_t)(sy + y) * surf->width + sx],
+			       node_row(n, y), n->width * 4);
+	}
+	if (surf->used != NULL)
+		surface_set_used(surf, sx, sy, n->width, n->height);
+}
+
+/* fingerprint of the pixels of an image */
+void image_fingerprint(struct node *n)
+{
+	uint64_t h = FNV64_INIT;
+	int y;
+
+	h = fnv64(h, &n->width, sizeof(n->width));
+	h = fnv64(h, &n->height, sizeof(n->height));
+	for (y=0; y<n->height; y++)
+		h = fnv64(h, node_row(n, y), n->width * 4);
+	n->fingerprint = h;
+}
+
+static inline
+int image_equal(struct node *a, struct node *b)
+{
+	int y;
+
+	if (a->width != b->width || a->height != b->height)
+		return 0;
+	for (y=0; y<a->height; y++)
+		if (memcmp(node_row(a, y), node_row(b, y), a->width * 4) != 0)
+			return 0;
+	return 1;
+}
+
+struct fpidx {
+	uint64_t fingerprint;
+	int idx;
+};
+
+static
+int compar_fingerprint(const void *ia, const void *ib)
+{
+	const struct fpidx *a = ia;
+	const struct fpidx *b = ib;
+
+	if (a->fingerprint != b->fingerprint)
+		return a->fingerprint < b->fingerprint ? -1 : 1;
+	return a->idx - b->idx;
+}
+
+/* search the images with the same pixels. For each set of identical
+ * images, the first one in <pool> (which is in argv order) is placed,
+ * the other ones become its aliases.
+ */
+void dedupe(struct node **pool, int nb_img)
+{
+	struct fpidx *sorted;
+	struct node *n;
+	int start;
+	int i;
+	int j;
+	int k;
+
+	sorted = malloc(sizeof(struct fpidx) * (nb_img + 1));
+	if (sorted == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i=0; i<nb_img; i++) {
+		sorted[i].fingerprint = pool[i]->fingerprint;
+		sorted[i].idx = i;
+	}
+	qsort(sorted, nb_img, sizeof(struct fpidx), compar_fingerprint);
+
+	for (start=0; start<nb_img; start=i) {
+
+		/* group of images with the same fingerprint, in argv order */
+		for (i=start+1; i<nb_img && sorted[i].fingerprint == sorted[start].fingerprint; i++);
+
+		/* each image is compared with the previous masters */
+		for (j=start+1; j<i; j++) {
+			n = pool[sorted[j].idx];
+			for (k=start; k<j; k++) {
+				if (pool[sorted[k].idx]->alias == NULL &&
+				    image_equal(pool[sorted[k].idx], n)) {
+					n->alias = pool[sorted[k].idx];
+					break;
+				}
+			}
+		}
+	}
+	free(sorted);
+}
+
+int compar(const void *ia, const void *ib)
+{
+	const struct node * const *ia1 = ia;
+	const struct node * const *ib1 = ib;
+	const struct node *a = *ia1;
+	const struct node *b = *ib1;
+
+	return a->surface < b->surface;
+}
+
+char *do_azname(const char *name)
+{
+	char *p;
+	char *n;
+
+	/* search path component */
+	p = strchr(name, '/');
+	if (p == NULL)
+		p = (char *)name;
+	else
+		p++;
+
+	/* copy name without path component */
+	n = strdup(p);
+	if (n == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	/* remove extension */
+	p = strrchr(n, '.');
+	if (p != NULL)
+		*p = '\0';
+
+	/* check each char */
+	for (p = n;
+	     *p != '\0';
+	     p++) {
+
+		/* lower case */
+		if (*p >= 'A' && *p <= 'Z')
+			*p = tolower(*p);
+
+		/* replace bad char */
+		if ( (*p < 'a' || *p > 'z') &&
+		     (*p < '0' || *p > '9') &&
+		     *p != '_')
+			*p = '_';
+	}
+
+	return n;
+}
+
+static inline
+int hex_conv(char c)
+{
+	if (c >= '0' && c <= '9')
+		return c - '0';
+	if (c >= 'a' && c <= 'f')
+		return c - 'a' + 10;
+	if (c >= 'A' && c <= 'F')
+		return c - 'A' + 10;
+	return -1;
+}
+
+static inline
+int byte_conv(char *c)
+{
+	int res1;
+	int res2;
+
+	res1 = hex_conv(c[0]);
+	res2 = hex_conv(c[1]);
+	if (res1 < 0 || res2 < 0)
+		return -1;
+	return ( res1 << 4 ) + res2;
+}
+
+static inline
+int color_conv(char *in, struct color *c)
+{
+	int r;
+	int g;
+	int b;
+
+	r = byte_conv(&in[0]);
+	g = byte_conv(&in[2]);
+	b = byte_conv(&in[4]);
+
+	if (r < 0 || g < 0 || b < 0)
+		return -1;
 
 	c->r = r;
 	c->g = g;
 	c->b = b;
 
-	return 0;
+	return 0;
+}
+
+/* one image to load, and the result of the load */
+struct load {
+	const char *name;
+	struct node *node;
+	struct imgerr err;
+	struct cache_input *cached;  /* previous build of this input */
+	struct fileinfo info;        /* fingerprint, with the cache only */
+};
+
+struct load_job {
+	struct load *loads;
+	int nb;
+	int do_crop;
+	int direct;
+	int cache;
+	int dedupe;
+};
+
+/* load and crop one image, this runs in the worker threads. In direct
+ * mode, only the size of the image is read.
+ */
+static
+void load_task(void *arg, int i)
+{
+	struct load_job *job = arg;
+	struct load *ld = &job->loads[i];
+	struct cache_input *ce;
+	double start;
+
+	/* the input did not change since the previous build, reuse its
+	 * size and its crop bounds.
+	 */
+	ld->info.path = (char *)ld->name;
+	if (job->cache && file_match(ld->name, ld->cached ? &ld->cached->f : NULL, &ld->info)) {
+		ce = ld->cached;
+		if (job->direct) {
+			ld->node = calloc(sizeof(struct node), 1);
+			if (ld->node == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+			ld->node->width = ce->width;
+			ld->node->height = ce->height;
+			ld->node->surface = ce->width * ce->height;
+			return;
+		}
+		ld->node = openimage(ld->name, READ_ALLOC, &ld->err);
+		if (ld->node != NULL && job->do_crop) {
+			start = stats_now();
+			crop_apply(ld->node, ce->crop_x, ce->crop_y, ce->width, ce->height);
+			trace_span("crop", start, ld->name, "width", ld->node->width,
+			           "height", ld->node->height);
+		}
+	}
+	else {
+		ld->node = openimage(ld->name, job->direct ? READ_PROBE : READ_ALLOC, &ld->err);
+		if (ld->node != NULL && job->do_crop) {
+			start = stats_now();
+			crop(ld->node);
+			trace_span("crop", start, ld->name, "width", ld->node->width,
+			           "height", ld->node->height);
+		}
+	}
+
+	if (ld->node != NULL && job->dedupe)
+		image_fingerprint(ld->node);
+}
+
+/* one placed image to decode into the canvas */
+struct decode_job {
+	struct node **pool;
+	struct surface *surf;
+	struct imgerr *errs;
+};
+
+/* decode one placed image directly at its place in the canvas, this
+ * runs in the worker threads. The images do not overlap, so the threads
+ * never write the same pixels.
+ */
+static
+void decode_task(void *arg, int i)
+{
+	struct decode_job *job = arg;
+	struct node *n = job->pool[i];
+	png_bytep *rows;
+	int y;
+
+	rows = malloc(sizeof(png_bytep) * (n->height + 1));
+	if (rows == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (y=0; y<n->height; y++)
+		rows[y] = (png_bytep)&job->surf->pixels[(size_t)(n->dest_y + y) * job->surf->width +
+		                                         n->dest_x];
+	if (decodeimage(n, rows, &job->errs[i]) < 0)
+		job->errs[i].fatal = 1;
+	free(rows);
+}
+
+/* the settings of the build, from the command line */
+struct config {
+	const char *output;        /* "XXXXXXXX" is replaced by the hash */
+	struct template *templates;
+	int qual;
+	int interlace;
+	struct color *alpha;
+	int do_crop;
+	int stream;
+	int threads;
+	int optimize;
+	int colors;
+	enum pack_algo pack;
+	const char *cache_file;
+	int stable;
+	int do_dedupe;
+	int direct;                /* the images are decoded into the canvas */
+	int watch;
+	const char *serve;         /* address of the server mode */
+	const char *stats_file;
+	const char *trace_file;
+	const char *list;          /* file with the names of the inputs */
+	int max_width;             /* sheet limits, 0 if none */
+	int max_height;
+	long long max_pixels;
+	int scales[SCALE_MAX];     /* densities of the outputs, biggest first */
+	int nb_scales;
+	int density;               /* of the input images, the biggest scale */
+	uint64_t options;          /* cache key */
+	char **deps;
+	int nb_deps;
+};
+
+/* load the images <loads> with the worker threads, and report the errors.
+ * Returns the number of fatal errors.
+ */
+int load_images(struct config *cfg, struct load *loads, int nb)
+{
+	struct load_job job;
+	int fatal = 0;
+	int i;
+
+	job.loads = loads;
+	job.nb = nb;
+	job.do_crop = cfg->do_crop;
+	job.direct = cfg->direct;
+	job.cache = cfg->cache_file != NULL;
+	job.dedupe = cfg->do_dedupe;
+	workpool_run(cfg->threads, nb, load_task, &job);
+
+	for (i=0; i<nb; i++) {
+		if (loads[i].err.msg[0] != '\0')
+			fprintf(stderr, "%s", loads[i].err.msg);
+		if (loads[i].err.fatal)
+			fatal++;
+
+		/* copy name */
+		if (loads[i].node != NULL) {
+			loads[i].node->name = (char *)loads[i].name;
+			loads[i].node->azname = do_azname(loads[i].name);
+		}
+	}
+	return fatal;
+}
+
+/* an output image kept in memory, for the server mode */
+struct memimage {
+	char *output;              /* name of the output image */
+	char *pattern;             /* the same before the hash */
+	unsigned int hash;
+	struct outbuf png;
+};
+
+/* outputs of a build kept in memory, for the server mode */
+struct memout {
+	int nb_img;
+	struct memimage *imgs;     /* one by sheet */
+	int nb_tpl;
+	struct outbuf *tpls;       /* in the order of the templates list */
+};
+
+/* one output image. Without the sheet limits, all the images are in
+ * the first and only sheet.
+ */
+struct sheet {
+	struct surface surf;
+	struct draw d;
+	struct node **pool;        /* the images placed in the sheet */
+	int nb_img;
+	int width;
+	int height;
+	int scale;
+	char *pattern;             /* name of the output image, before the hash */
+};
+
+/* name of the output image of the sheet <k> at the scale <scale>: the
+ * first one is <output>, the next ones have "-<k>" before the extension,
+ * and the scales other than 1 have "@<scale>x".
+ */
+char *sheet_name(const char *output, int k, int scale)
+{
+	const char *base;
+	const char *ext;
+	char *name;
+
+	name = malloc(strlen(output) + 32);
+	if (name == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	if (k == 0 && scale == 1) {
+		strcpy(name, output);
+		return name;
+	}
+	base = strrchr(output, '/');
+	base = base != NULL ? base + 1 : output;
+	ext = strrchr(base, '.');
+	if (ext == NULL || ext == base)
+		ext = output + strlen(output);
+	sprintf(name, "%.*s", (int)(ext - output), output);
+	if (k > 0)
+		sprintf(name + strlen(name), "-%d", k);
+	if (scale != 1)
+		sprintf(name + strlen(name), "@%dx", scale);
+	strcat(name, ext);
+	return name;
+}
+
+/* place the images <todo> in the sheet <sh>, in their order. The images
+ * which do not fit in the sheet limits are moved at the begining of
+ * <todo>, and their number is returned. With the stable layout, <cache>
+ * gives the places of the previous build. With --scales, the sizes are in
+ * CSS pixels and the canvas is not allocated, see sheet_expand().
+ */
+int place_sheet(struct config *cfg, struct sheet *sh, struct node **todo, int nb,
+                struct cache *cache)
+{
+	long long smin = 0;
+	int ymax = 0;
+	int xmin = 0;
+	int larg;
+	int i;
+	struct node *node;
+	int top = 0;
+	int left = 0;
+	int placed = 0;
+	struct skyline sky;
+	struct maxrects mr;
+	struct cache_input *ce;
+	unsigned char *kept;
+	int bottom;
+	long long probes;
+	double start;
+	int max_width = cfg->max_width;
+	int max_height = cfg->max_height;
+	long long max_pixels = cfg->max_pixels;
+
+	/* the limits are the ones of the biggest output image */
+	if (cfg->density > 1) {
+		if (max_width > 0)
+			max_width = max_width > cfg->density ? max_width / cfg->density : 1;
+		if (max_height > 0)
+			max_height = max_height > cfg->density ? max_height / cfg->density : 1;
+		if (max_pixels > 0) {
+			max_pixels /= cfg->density * cfg->density;
+			if (max_pixels < 1)
+				max_pixels = 1;
+		}
+	}
+
+	for (i=0; i<nb; i++) {
+		node = todo[i];
+
+		/* an image bigger than the sheet limits cannot be placed */
+		if ((max_width > 0 && node->width > max_width) ||
+		    (max_height > 0 && node->height > max_height) ||
+		    (max_pixels > 0 && (long long)node->width * node->height > max_pixels)) {
+			fprintf(stderr, "cannot place image \"%s\" in the sheet limits\n",
+			        node->name);
+			exit(1);
+		}
+
+		/* calcul de la surface minimale */
+		smin += node->surface;
+
+		/* calcul de la largeur minimale */
+		if (node->width > xmin)
+			xmin = node->width;
+
+		/* hauteur maximale */
+		ymax += node->height;
+	}
+
+	/* Calcule la largeur */
+	larg = sqrt(smin) + 1;
+	if (larg < xmin)
+		larg = xmin;
+
+	/* the width limits. The sheet is never wider, the images which do
+	 * not fit go to the next sheet, but the first one always fits.
+	 */
+	if (max_pixels > 0 && larg > sqrt(max_pixels))
+		larg = sqrt(max_pixels);
+	if (max_width > 0 && larg > max_width)
+		larg = max_width;
+	if (larg < todo[0]->width)
+		larg = todo[0]->width;
+	if (max_pixels > 0 && todo[0]->height > max_pixels / larg)
+		larg = max_pixels / todo[0]->height;
+
+	/* the height limits */
+	if (max_height > 0 && ymax > max_height)
+		ymax = max_height;
+	if (max_pixels > 0 && ymax > max_pixels / larg)
+		ymax = max_pixels / larg;
+
+	/* stable layout: the images with the same name and the same size
+	 * than in the previous build keep their place. The other ones are
+	 * placed in the free space or below.
+	 */
+	kept = calloc(1, nb + 1);
+	sh->pool = malloc(sizeof(struct node *) * (nb + 1));
+	if (kept == NULL || sh->pool == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	if (cfg->stable && cache->width > 0) {
+		if (cache->width > larg)
+			larg = cache->width;
+		ymax = 0;
+		bottom = 0;
+		for (i=0; i<nb; i++) {
+			node = todo[i];
+			ce = cache_lookup(cache, node->name);
+			if (ce != NULL && !ce->taken &&
+			    ce->width == node->width && ce->height == node->height &&
+			    ce->dest_x + ce->width <= larg) {
+				ce->taken = 1;
+				kept[i] = 1;
+				node->dest_x = ce->dest_x;
+				node->dest_y = ce->dest_y;
+				if (bottom < ce->dest_y + ce->height)
+					bottom = ce->dest_y + ce->height;
+			}
+			else
+				ymax += node->height;
+		}
+		ymax += bottom;
+	}
+
+	/* memoire pour la surface de placement */
+	surface_init(&sh->surf, larg, ymax, !cfg->stream && cfg->density == 1,
+	             !cfg->stream || cfg->pack == PACK_FIRSTFIT);
+	if (sh->surf.pixels != NULL)
+		stats.canvas_bytes += (long long)larg * ymax * 4;
+	if (sh->surf.used != NULL)
+		stats.canvas_bytes += (long long)sh->surf.words * ymax * 8 + (long long)ymax * 8;
+	stats.ymax += ymax;
+
+	/* init the packer */
+	if (cfg->pack == PACK_SKYLINE)
+		skyline_init(&sky, larg, nb);
+	else if (cfg->pack == PACK_MAXRECTS)
+		maxrects_init(&mr, larg, ymax);
+
+	/* the kept images are placed first */
+	sh->nb_img = 0;
+	for (i=0; i<nb; i++) {
+		if (!kept[i])
+			continue;
+		node = todo[i];
+		if (cfg->pack == PACK_SKYLINE)
+			skyline_raise(&sky, node->dest_x, node->width, node->dest_y + node->height);
+		else if (cfg->pack == PACK_MAXRECTS)
+			maxrects_use(&mr, node);
+		fill(&sh->surf, node->dest_x, node->dest_y, node);
+		sh->pool[sh->nb_img++] = node;
+		if (top < node->dest_y + node->height)
+			top = node->dest_y + node->height;
+	}
+
+	/* on va placer les locs par ordre de taille */
+	for (i=0; i<nb; i++) {
+
+		/* get node */
+		node = todo[i];
+		if (kept[i])
+			continue;
+
+		/* on place le noeud */
+		start = stats_now();
+		probes = stats.probes;
+		switch (cfg->pack) {
+		case PACK_FIRSTFIT:
+			placed = firstfit_place(&sh->surf, ymax, node);
+			break;
+		case PACK_SKYLINE:
+			placed = skyline_place(&sky, ymax, node);
+			break;
+		case PACK_MAXRECTS:
+			placed = maxrects_place(&mr, node);
+			break;
+		}
+		if (stats.probes_max < stats.probes - probes)
+			stats.probes_max = stats.probes - probes;
+
+		/* for the next sheet */
+		if (!placed) {
+			todo[left++] = node;
+			continue;
+		}
+
+		fill(&sh->surf, node->dest_x, node->dest_y, node);
+		sh->pool[sh->nb_img++] = node;
+		trace_span("place", start, node->name, "probes", stats.probes - probes,
+		           "y", node->dest_y);
+
+		/* on met  jour la hauteur de l'image */
+		if (top < node->dest_y + node->height)
+			top = node->dest_y + node->height;
+	}
+
+	sh->width = larg;
+	sh->height = top;
+	sh->scale = cfg->density;
+
+	if (cfg->pack == PACK_SKYLINE) {
+		free(sky.segs);
+		free(sky.tmp);
+	}
+	else if (cfg->pack == PACK_MAXRECTS)
+		free(mr.free);
+	free(kept);
+	return left;
+}
+
+/* the canvas of an output image, with the occupancy for the -na blend.
+ * There is none in streaming mode.
+ */
+void surface_canvas(struct config *cfg, struct surface *surf, int width, int height)
+{
+	surface_init(surf, width, height, !cfg->stream, !cfg->stream);
+	if (surf->pixels != NULL)
+		stats.canvas_bytes += (long long)width * height * 4 +
+		                      (long long)surf->words * height * 8 + (long long)height * 8;
+}
+
+/* the sheet <sh>, placed in CSS pixels, goes to the pixels of the input
+ * images: the places are multiplied by the density, and the canvas is
+ * allocated at this size. The images must have their size back.
+ */
+void sheet_expand(struct config *cfg, struct sheet *sh)
+{
+	struct node *n;
+	int i;
+
+	surface_free(&sh->surf);
+	sh->width *= cfg->density;
+	sh->height *= cfg->density;
+	surface_canvas(cfg, &sh->surf, sh->width, sh->height);
+	for (i=0; i<sh->nb_img; i++) {
+		n = sh->pool[i];
+		n->dest_x *= cfg->density;
+		n->dest_y *= cfg->density;
+		fill(&sh->surf, n->dest_x, n->dest_y, n);
+	}
+}
+
+/* the images of one lower scale, downscaled in the worker threads */
+struct scale_job {
+	struct node **src;
+	struct node **dst;
+	struct surface **surf;
+	int from;
+	int to;
+};
+
+static
+void scale_task(void *arg, int i)
+{
+	struct scale_job *job = arg;
+	struct node *n = job->dst[i];
+	double start;
+
+	start = stats_now();
+	downscale(job->src[i], n, job->from, job->to);
+	fill(job->surf[i], n->dest_x, n->dest_y, n);
+	trace_span("scale", start, n->name, "width", n->width, "height", n->height);
+}
+
+/* the sheet <sh> at the scale <scale>, with the layout of the sheet <src>
+ * at the density of the input images. Its images are new nodes, added to
+ * <job> for the downscale.
+ */
+void sheet_scaled(struct config *cfg, struct sheet *sh, struct sheet *src, int scale,
+                  struct scale_job *job, int *nb)
+{
+	struct node *n;
+	int i;
+
+	memset(sh, 0, sizeof(*sh));
+	sh->scale = scale;
+	sh->width = src->width / cfg->density * scale;
+	sh->height = src->height / cfg->density * scale;
+	surface_canvas(cfg, &sh->surf, sh->width, sh->height);
+
+	sh->nb_img = src->nb_img;
+	sh->pool = malloc(sizeof(struct node *) * (sh->nb_img + 1));
+	if (sh->pool == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i=0; i<sh->nb_img; i++) {
+		n = malloc(sizeof(struct node));
+		if (n == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		*n = *src->pool[i];
+		n->dest_x = n->dest_x / cfg->density * scale;
+		n->dest_y = n->dest_y / cfg->density * scale;
+		n->pixels = NULL;
+		n->alias = NULL;
+		sh->pool[i] = n;
+
+		job->src[*nb] = src->pool[i];
+		job->dst[*nb] = n;
+		job->surf[*nb] = &sh->surf;
+		(*nb)++;
+	}
+}
+
+struct encode_job {
+	struct config *cfg;
+	struct sheet *sheets;
+	struct general *gens;
+	struct memout *mem;
+	int threads;
+};
+
+/* encode the output image of one sheet, this runs in the worker threads */
+static
+void encode_task(void *arg, int k)
+{
+	struct encode_job *job = arg;
+	struct config *cfg = job->cfg;
+
+	drawpng(&job->sheets[k].d, cfg->interlace, job->gens[k].output, job->threads,
+	        cfg->optimize, cfg->colors, job->mem ? &job->mem->imgs[k].png : NULL);
+}
+
+/* place the loaded images <loads>, then write the output images, the
+ * templates and the cache. <cache> is the previous build. With <mem>, the
+ * outputs are kept in memory and the cache is not written.
+ */
+void build(struct config *cfg, struct load *loads, int nb, struct cache *cache,
+           struct memout *mem)
+{
+	long long smin = 0;
+	int i;
+	int k;
+	struct node **pool;
+	struct node **todo;
+	struct node *node;
+	int nb_img;
+	int nb_todo;
+	struct sheet *sheets;
+	struct sheet *sh;
+	int nb_sheets;
+	int nb_base;
+	int left;
+	png_uint_32 *dims;
+	struct scale_job sjob;
+	int nb_scaled;
+	int j;
+	struct template *tpl;
+	struct tpl_render render;
+	struct general *gens;
+	struct encode_job ejob;
+	int threads;
+	char *p;
+	char hashstr[9];
+	uint32_t extra[6];
+	struct decode_job djob;
+	struct cache ncache;
+	struct cache_input *ce;
+	struct stats_clock t0;
+	struct fileinfo fi;
+
+	/* index the images in the argv order */
+	stats_start(&t0);
+	pool = calloc(sizeof(struct node *), nb + 1);
+	if (pool == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	nb_img = 0;
+	for (i=0; i<nb; i++) {
+		node = loads[i].node;
+		if (node == NULL)
+			continue;
+		node->alias = NULL;
+		node->sheet = 0;
+		pool[nb_img++] = node;
+	}
+
+	/* the identical images are placed once */
+	if (cfg->do_dedupe)
+		dedupe(pool, nb_img);
+
+	for (i=0; i<nb_img; i++)
+		if (pool[i]->alias == NULL)
+			smin += pool[i]->surface;
+
+	/* nothing to do */
+	if (nb_img == 0) {
+		free(pool);
+		return;
+	}
+	stats.images = nb_img;
+	stats.smin = smin;
+
+	/* on ordone les images */
+	qsort(pool, nb_img, sizeof(struct node *), compar);
+	stats_end(&t0, PHASE_SORT);
+	stats_start(&t0);
+
+	/* the images are placed in sheets. The ones which do not fit in the
+	 * sheet limits go to the next sheet.
+	 */
+	todo = malloc(sizeof(struct node *) * (nb_img + 1));
+	if (todo == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	nb_todo = 0;
+	for (i=0; i<nb_img; i++)
+		if (pool[i]->alias == NULL)
+			todo[nb_todo++] = pool[i];
+
+	/* with --scales, the layout is in CSS pixels: the size of the images
+	 * is divided by the density, rounded up, so the places are at whole
+	 * pixels at all the scales.
+	 */
+	dims = malloc(sizeof(png_uint_32) * 2 * (nb_img + 1));
+	if (dims == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i=0; cfg->density > 1 && i<nb_img; i++) {
+		node = pool[i];
+		dims[i * 2] = node->width;
+		dims[i * 2 + 1] = node->height;
+		node->width = (node->width + cfg->density - 1) / cfg->density;
+		node->height = (node->height + cfg->density - 1) / cfg->density;
+		node->surface = node->width * node->height;
+	}
+
+	stats.canvas_bytes = 0;
+	stats.ymax = 0;
+	stats.probes = 0;
+	stats.probes_max = 0;
+	stats.width = 0;
+	stats.height = 0;
+	stats.area = 0;
+	sheets = NULL;
+	nb_sheets = 0;
+	while (nb_todo > 0) {
+		sheets = realloc(sheets, sizeof(struct sheet) * (nb_sheets + 1));
+		if (sheets == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		sh = &sheets[nb_sheets];
+		left = place_sheet(cfg, sh, todo, nb_todo, cache);
+		if (left == nb_todo) {
+			fprintf(stderr, "cannot place image \"%s\" in the sheet limits\n",
+			        todo[0]->name);
+			exit(1);
+		}
+		for (i=0; i<sh->nb_img; i++)
+			sh->pool[i]->sheet = nb_sheets;
+		nb_sheets++;
+		nb_todo = left;
+	}
+	free(todo);
+
+	/* back to the size of the input images */
+	for (i=0; cfg->density > 1 && i<nb_img; i++) {
+		node = pool[i];
+		node->width = dims[i * 2];
+		node->height = dims[i * 2 + 1];
+		node->surface = node->width * node->height;
+	}
+	free(dims);
+	for (k=0; cfg->density > 1 && k<nb_sheets; k++)
+		sheet_expand(cfg, &sheets[k]);
+
+	for (k=0; k<nb_sheets; k++) {
+		if (stats.width < sheets[k].width)
+			stats.width = sheets[k].width;
+		stats.height += sheets[k].height;
+		stats.area += (long long)sheets[k].width * sheets[k].height;
+	}
+	stats.sheets = nb_sheets;
+
+	/* the aliases share the place of their image */
+	for (i=0; i<nb_img; i++) {
+		if (pool[i]->alias != NULL) {
+			pool[i]->dest_x = pool[i]->alias->dest_x;
+			pool[i]->dest_y = pool[i]->alias->dest_y;
+			pool[i]->sheet = pool[i]->alias->sheet;
+		}
+	}
+
+	stats_end(&t0, PHASE_PACK);
+
+	/* decode the images at their place */
+	stats_start(&t0);
+	for (k=0; cfg->direct && k<nb_sheets; k++) {
+		djob.pool = sheets[k].pool;
+		djob.surf = &sheets[k].surf;
+		djob.errs = calloc(sizeof(struct imgerr), sheets[k].nb_img + 1);
+		if (djob.errs == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		workpool_run(cfg->threads, sheets[k].nb_img, decode_task, &djob);
+		for (i=0; i<sheets[k].nb_img; i++) {
+			if (djob.errs[i].msg[0] != '\0')
+				fprintf(stderr, "%s", djob.errs[i].msg);
+			if (djob.errs[i].fatal)
+				exit(1);
+		}
+		free(djob.errs);
+	}
+
+	stats_end(&t0, PHASE_DECODE);
+
+	/* the lower scales: the same sheets, with the images downscaled. They
+	 * follow the sheets of the input density, from the biggest scale.
+	 */
+	stats_start(&t0);
+	nb_base = nb_sheets;
+	if (cfg->nb_scales > 1) {
+		sheets = realloc(sheets, sizeof(struct sheet) * nb_base * cfg->nb_scales);
+		sjob.src = malloc(sizeof(struct node *) * (nb_img + 1));
+		sjob.dst = malloc(sizeof(struct node *) * (nb_img + 1));
+		sjob.surf = malloc(sizeof(struct surface *) * (nb_img + 1));
+		if (sheets == NULL || sjob.src == NULL || sjob.dst == NULL || sjob.surf == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		sjob.from = cfg->density;
+		for (j=1; j<cfg->nb_scales; j++) {
+			nb_scaled = 0;
+			for (k=0; k<nb_base; k++)
+				sheet_scaled(cfg, &sheets[nb_sheets++], &sheets[k], cfg->scales[j],
+				             &sjob, &nb_scaled);
+			sjob.to = cfg->scales[j];
+			workpool_run(cfg->threads, nb_scaled, scale_task, &sjob);
+		}
+		free(sjob.src);
+		free(sjob.dst);
+		free(sjob.surf);
+	}
+	stats_end(&t0, PHASE_SCALE);
+
+	/* img sign: the pixels of the output image, its size and the
+	 * options which change the file, interlace included. The hash is
+	 * written in a copy of the output name.
+	 */
+	stats_start(&t0);
+	gens = calloc(sizeof(struct general), nb_sheets);
+	if (gens == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (k=0; k<nb_sheets; k++) {
+		sh = &sheets[k];
+		draw_init(&sh->d, &sh->surf, sh->pool, sh->nb_img, sh->height,
+		          cfg->qual, cfg->alpha);
+		extra[0] = sh->width;
+		extra[1] = sh->height;
+		extra[2] = cfg->qual;
+		extra[3] = cfg->alpha != NULL;
+		extra[4] = cfg->colors;
+		extra[5] = cfg->interlace;
+		gens[k].hash = draw_hash(&sh->d, cfg->threads, extra, 6);
+		gens[k].scale = sh->scale;
+		gens[k].unit = cfg->density;
+		gens[k].width = sh->width / sh->scale;
+		gens[k].height = sh->height / sh->scale;
+
+		/* Apply hash on the output images */
+		sh->pattern = sheet_name(cfg->output, k % nb_base, sh->scale);
+		gens[k].output = p = strdup(sh->pattern);
+		if (p == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+		p = strstr(p, "XXXXXXXX");
+		if (p) {
+			snprintf(hashstr, 9, "%08x", gens[k].hash);
+			memcpy(p, hashstr, 8);
+		}
+	}
+	stats_end(&t0, PHASE_HASH);
+
+	/* the outputs in memory, one image by sheet */
+	if (mem != NULL) {
+		for (k=0; k<mem->nb_img; k++) {
+			free(mem->imgs[k].output);
+			free(mem->imgs[k].pattern);
+			free(mem->imgs[k].png.buf);
+		}
+		free(mem->imgs);
+		mem->nb_img = nb_sheets;
+		mem->imgs = calloc(sizeof(struct memimage), nb_sheets);
+		if (mem->imgs == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+
+	/* render the templates. They only need the layout and the hash, so
+	 * with several threads they are rendered while the image is encoded.
+	 */
+	tpl_render_start(&render, cfg->templates, pool, nb_img, gens, nb_base,
+	                 cfg->nb_scales, cfg->threads, mem ? mem->tpls : NULL);
+
+	/* draw png outpout image. Each sheet is encoded by its own thread,
+	 * the threads, less the one of the background rendering, are shared
+	 * between them.
+	 */
+	stats_start(&t0);
+	threads = render.async ? cfg->threads - 1 : cfg->threads;
+	ejob.cfg = cfg;
+	ejob.sheets = sheets;
+	ejob.gens = gens;
+	ejob.mem = mem;
+	ejob.threads = threads / nb_sheets > 1 ? threads / nb_sheets : 1;
+	workpool_run(threads, nb_sheets, encode_task, &ejob);
+	for (k=0; k<nb_sheets; k++)
+		draw_free(&sheets[k].d);
+	stats_end(&t0, PHASE_ENCODE);
+	tpl_render_wait(&render);
+
+	if (cfg->stats_file) {
+		stats.png_bytes = 0;
+		for (k=0; k<nb_sheets; k++) {
+			if (mem != NULL)
+				stats.png_bytes += mem->imgs[k].png.len;
+			else if (file_stat(gens[k].output, &fi) == 0)
+				stats.png_bytes += fi.size;
+		}
+		stats_write(cfg->stats_file, img_arena.used);
+	}
+	if (cfg->trace_file)
+		trace_write(cfg->trace_file);
+
+	/* the names of the images are kept with the outputs */
+	if (mem != NULL) {
+		for (k=0; k<nb_sheets; k++) {
+			mem->imgs[k].output = (char *)gens[k].output;
+			mem->imgs[k].pattern = sheets[k].pattern;
+			mem->imgs[k].hash = gens[k].hash;
+			gens[k].output = NULL;
+			sheets[k].pattern = NULL;
+		}
+	}
+
+	/* save the build cache */
+	if (cfg->cache_file && mem == NULL) {
+		memset(&ncache, 0, sizeof(ncache));
+		ncache.options = cfg->options;
+		ncache.crop = cfg->do_crop;
+		ncache.width = sheets[0].width;
+		ncache.hash = gens[0].hash;
+
+		ncache.deps = calloc(sizeof(struct fileinfo), cfg->nb_deps + 1);
+		ncache.nb_outputs = nb_sheets;
+		for (tpl = cfg->templates; tpl != NULL; tpl = tpl->next)
+			ncache.nb_outputs++;
+		ncache.outputs = calloc(sizeof(struct fileinfo), ncache.nb_outputs + 1);
+		ncache.inputs = calloc(sizeof(struct cache_input), nb + 1);
+		if (ncache.deps == NULL || ncache.outputs == NULL || ncache.inputs == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+
+		for (i=0; i<cfg->nb_deps; i++) {
+			ncache.deps[i].path = cfg->deps[i];
+			file_match(cfg->deps[i], NULL, &ncache.deps[i]);
+		}
+		ncache.nb_deps = cfg->nb_deps;
+
+		i = 0;
+		for (k=0; k<nb_sheets; k++) {
+			ncache.outputs[i].path = (char *)gens[k].output;
+			file_stat(gens[k].output, &ncache.outputs[i++]);
+		}
+		for (tpl = cfg->templates; tpl != NULL; tpl = tpl->next) {
+			ncache.outputs[i].path = (char *)tpl->out_file;
+			file_stat(tpl->out_file, &ncache.outputs[i++]);
+		}
+		ncache.nb_outputs = i;
+
+		for (i=0; i<nb; i++) {
+			if (loads[i].node == NULL)
+				continue;
+			ce = &ncache.inputs[ncache.nb_inputs++];
+			ce->f = loads[i].info;
+			ce->width = loads[i].node->width;
+			ce->height = loads[i].node->height;
+			ce->crop_x = loads[i].node->crop_x;
+			ce->crop_y = loads[i].node->crop_y;
+			ce->dest_x = loads[i].node->dest_x;
+			ce->dest_y = loads[i].node->dest_y;
+		}
+
+		cache_save(&ncache, cfg->cache_file);
+		free(ncache.deps);
+		free(ncache.outputs);
+		free(ncache.inputs);
+	}
+
+	for (k=0; k<nb_sheets; k++) {
+		surface_free(&sheets[k].surf);
+
+		/* the downscaled images */
+		for (i=0; k >= nb_base && i<sheets[k].nb_img; i++) {
+			free(sheets[k].pool[i]->pixels);
+			free(sheets[k].pool[i]);
+		}
+		free(sheets[k].pool);
+		free(sheets[k].pattern);
+		free((char *)gens[k].output);
+	}
+	free(sheets);
+	free(gens);
+	free(pool);
+}
+/*
+ * Watch mode. The directories of the input images and of the templates
+ * are watched with inotify, because the editors often replace the files.
+ * The decoded images stay in memory, and after a change only the changed
+ * files are loaded again before the build.
+ */
+#define WATCH_DELAY 50    /* ms without events before the build */
+
+struct watch_file {
+	int wd;
+	const char *base;
+};
+
+struct watch {
+	int fd;
+	int nb;
+	struct watch_file *files;   /* the images, then the templates */
+	char *changed;
+};
+
+void watch_add(struct watch *w, const char *path)
+{
+	struct watch_file *f = &w->files[w->nb++];
+	const char *p;
+	char *dir;
+
+	p = strrchr(path, '/');
+	if (p == NULL) {
+		dir = strdup(".");
+		f->base = path;
+	}
+	else {
+		dir = strndup(path, p - path + 1);
+		f->base = p + 1;
+	}
+	if (dir == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+
+	/* the same directory gives the same watch descriptor */
+	f->wd = inotify_add_watch(w->fd, dir,
+	                          IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE);
+	if (f->wd < 0) {
+		fprintf(stderr, "cannot watch directory \"%s\": %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	free(dir);
+}
+
+/* read the pending events, and flag the changed files. Returns the number
+ * of changed files.
+ */
+int watch_read(struct watch *w)
+{
+	char buf[65536] __attribute__((aligned(__alignof__(struct inotify_event))));
+	struct inotify_event *ev;
+	ssize_t len;
+	char *p;
+	int nb = 0;
+	int i;
+
+	len = read(w->fd, buf, sizeof(buf));
+	if (len < 0) {
+		if (errno == EINTR || errno == EAGAIN)
+			return 0;
+		fprintf(stderr, "cannot read inotify events: %s\n", strerror(errno));
+		exit(1);
+	}
+	for (p = buf; p < buf + len; p += sizeof(struct inotify_event) + ev->len) {
+		ev = (struct inotify_event *)p;
+		if (ev->len == 0)
+			continue;
+		for (i=0; i<w->nb; i++) {
+			if (w->files[i].wd == ev->wd && !w->changed[i] &&
+			    strcmp(w->files[i].base, ev->name) == 0) {
+				w->changed[i] = 1;
+				nb++;
+			}
+		}
+	}
+	return nb;
+}
+
+/* the images loaded again leave their previous pixels in the arena. When
+ * the arena is more than twice the size of the images in use, they are
+ * copied into a new arena and the old one is released.
+ */
+void watch_compact(struct load *loads, int nb)
+{
+	struct arena old;
+	struct node *n;
+	png_bytep pixels;
+	size_t live = 0;
+	int i;
+	int y;
+
+	for (i=0; i<nb; i++)
+		if (loads[i].node != NULL)
+			live += (size_t)loads[i].node->width * loads[i].node->height * 4 + ARENA_ALIGN;
+	if (img_arena.total <= live * 2 + ARENA_CHUNK)
+		return;
+
+	pthread_mutex_init(&old.lock, NULL);
+	old.chunks = img_arena.chunks;
+	old.total = img_arena.total;
+	old.used = img_arena.used;
+	img_arena.chunks = NULL;
+	img_arena.total = 0;
+	img_arena.used = 0;
+
+	for (i=0; i<nb; i++) {
+		n = loads[i].node;
+		if (n == NULL)
+			continue;
+		pixels = arena_alloc(&img_arena, (size_t)n->width * 4 * n->height);
+		for (y=0; y<n->height; y++)
+			memcpy(pixels + (size_t)n->width * 4 * y, node_row(n, y), (size_t)n->width * 4);
+		n->pixels = pixels;
+		n->stride = (size_t)n->width * 4;
+	}
+	arena_release(&old);
+	pthread_mutex_destroy(&old.lock);
+}
+
+/* load again the images flagged in <changed>, and the templates if
+ * <tpl_changed>, then build again. An image or a template which cannot
+ * be loaded keeps its previous version.
+ */
+void rebuild(struct config *cfg, struct load *loads, int nb, char *changed,
+             int tpl_changed, struct cache *cache, struct memout *mem)
+{
+	struct template *tpl;
+	struct load *reload;
+	struct timeval start;
+	struct timeval end;
+	struct stats_clock t0;
+	int nb_reload;
+	int i;
+	int k;
+
+	gettimeofday(&start, NULL);
+
+	/* the templates are small, they are all loaded again */
+	if (tpl_changed)
+		for (tpl = cfg->templates; tpl != NULL; tpl = tpl->next)
+			reload_tpl(tpl);
+
+	/* load the changed images */
+	reload = calloc(sizeof(struct load), nb + 1);
+	if (reload == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	nb_reload = 0;
+	for (i=0; i<nb; i++) {
+		if (!changed[i])
+			continue;
+		changed[i] = 0;
+		reload[nb_reload++].name = loads[i].name;
+	}
+	stats_start(&t0);
+	load_images(cfg, reload, nb_reload);
+	stats_end(&t0, PHASE_LOAD);
+
+	for (i=0, k=0; k<nb_reload; k++) {
+		while (loads[i].name != reload[k].name)
+			i++;
+		if (reload[k].err.fatal) {
+			fprintf(stderr, "keeping the previous version of \"%s\"\n", loads[i].name);
+			continue;
+		}
+		if (loads[i].node != NULL) {
+			free(loads[i].node->azname);
+			free(loads[i].node);
+		}
+		loads[i].node = reload[k].node;
+		loads[i].info = reload[k].info;
+	}
+	free(reload);
+	watch_compact(loads, nb);
+
+	/* the stable layout starts from the previous build */
+	if (cfg->stable && mem == NULL) {
+		cache_free(cache);
+		cache_load(cache, cfg->cache_file);
+	}
+
+	build(cfg, loads, nb, cache, mem);
+
+	gettimeofday(&end, NULL);
+	fprintf(stderr, "%d images loaded again, built in %ld ms\n", nb_reload,
+	        (end.tv_sec - start.tv_sec) * 1000 + (end.tv_usec - start.tv_usec) / 1000);
+}
+
+/* build again after each change of the inputs, never returns */
+void watch_loop(struct config *cfg, struct load *loads, int nb, struct cache *cache)
+{
+	struct watch w;
+	struct pollfd pfd;
+	int tpl_changed;
+	int i;
+
+	w.fd = inotify_init1(IN_CLOEXEC);
+	if (w.fd < 0) {
+		fprintf(stderr, "cannot init inotify: %s\n", strerror(errno));
+		exit(1);
+	}
+	w.nb = 0;
+	w.files = calloc(sizeof(struct watch_file), nb + cfg->nb_deps + 1);
+	w.changed = calloc(1, nb + cfg->nb_deps + 1);
+	if (w.files == NULL || w.changed == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i=0; i<nb; i++)
+		watch_add(&w, loads[i].name);
+	for (i=0; i<cfg->nb_deps; i++)
+		watch_add(&w, cfg->deps[i]);
+
+	pfd.fd = w.fd;
+	pfd.events = POLLIN;
+	while (1) {
+
+		/* wait for a change, then until the changes stop */
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR) {
+			fprintf(stderr, "cannot wait inotify events: %s\n", strerror(errno));
+			exit(1);
+		}
+		if (watch_read(&w) == 0)
+			continue;
+		while (poll(&pfd, 1, WATCH_DELAY) > 0)
+			watch_read(&w);
+
+		tpl_changed = 0;
+		for (i=nb; i<w.nb; i++) {
+			tpl_changed |= w.changed[i];
+			w.changed[i] = 0;
+		}
+		rebuild(cfg, loads, nb, w.changed, tpl_changed, cache, NULL);
+	}
+}
+
+/*
+ * Server mode. The outputs are kept in memory and served over HTTP on a
+ * Unix socket or on a localhost TCP port. On each request, the inputs
+ * are checked, and the changed ones are loaded again before the answer.
+ * The ETag is the imgcssmap hash, so the conditional requests of the
+ * browsers get a 304 until the image changes.
+ */
+#define SERVE_REQ_SIZE 8192
+
+struct server {
+	int fd;
+	int nb_files;
+	struct fileinfo *files;    /* the images, then the templates */
+	char *changed;
+	struct memout out;
+};
+
+/* open the listening socket. An <addr> with a '/' is a Unix socket,
+ * otherwise it is a TCP port on 127.0.0.1.
+ */
+int serve_listen(const char *addr)
+{
+	struct sockaddr_un sun;
+	struct sockaddr_in sin;
+	char *error;
+	long port;
+	int one = 1;
+	int fd;
+
+	if (strchr(addr, '/') != NULL) {
+		if (strlen(addr) >= sizeof(sun.sun_path)) {
+			fprintf(stderr, "socket path too long \"%s\"\n", addr);
+			exit(1);
+		}
+		memset(&sun, 0, sizeof(sun));
+		sun.sun_family = AF_UNIX;
+		strcpy(sun.sun_path, addr);
+		unlink(addr);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd < 0 || bind(fd, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+			goto fail;
+	}
+	else {
+		port = strtol(addr, &error, 10);
+		if (*error != '\0' || port < 1 || port > 65535) {
+			fprintf(stderr, "option --serve expect a socket path or a port\n");
+			usage();
+			exit(1);
+		}
+		memset(&sin, 0, sizeof(sin));
+		sin.sin_family = AF_INET;
+		sin.sin_port = htons(port);
+		sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		fd = socket(AF_INET, SOCK_STREAM, 0);
+		if (fd < 0)
+			goto fail;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+		if (bind(fd, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+			goto fail;
+	}
+	if (listen(fd, 16) < 0)
+		goto fail;
+	return fd;
+
+fail:
+	fprintf(stderr, "cannot listen on \"%s\": %s\n", addr, strerror(errno));
+	exit(1);
+}
+
+/* flag the files changed since the previous check. Returns 1 if a
+ * template changed.
+ */
+int serve_check(struct server *srv, int nb)
+{
+	struct fileinfo f;
+	int tpl_changed = 0;
+	int i;
+
+	for (i=0; i<srv->nb_files; i++) {
+		if (file_stat(srv->files[i].path, &f) < 0)
+			memset(&f, 0, sizeof(f));
+		if (f.size == srv->files[i].size &&
+		    f.mtime_sec == srv->files[i].mtime_sec &&
+		    f.mtime_nsec == srv->files[i].mtime_nsec)
+			continue;
+		srv->files[i].size = f.size;
+		srv->files[i].mtime_sec = f.mtime_sec;
+		srv->files[i].mtime_nsec = f.mtime_nsec;
+		if (i < nb)
+			srv->changed[i] = 1;
+		else
+			tpl_changed = 1;
+	}
+	return tpl_changed;
+}
+
+/* send all the data, the client errors are ignored */
+int serve_send(int fd, const char *buf, size_t len)
+{
+	ssize_t ret;
+
+	while (len > 0) {
+		ret = send(fd, buf, len, MSG_NOSIGNAL);
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		buf += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/* content type from the extension of <name> */
+const char *serve_type(const char *name)
+{
+	const char *ext;
+
+	ext = strrchr(name, '.');
+	if (ext == NULL)
+		return "text/plain";
+	ext++;
+	/**/ if (strcasecmp(ext, "png") == 0)
+		return "image/png";
+	else if (strcasecmp(ext, "css") == 0)
+		return "text/css";
+	else if (strcasecmp(ext, "js") == 0)
+		return "application/javascript";
+	else if (strcasecmp(ext, "json") == 0)
+		return "application/json";
+	else if (strcasecmp(ext, "html") == 0 || strcasecmp(ext, "htm") == 0)
+		return "text/html";
+	return "text/plain";
+}
+
+/* the file name of a path */
+const char *serve_base(const char *path)
+{
+	const char *p;
+
+	p = strrchr(path, '/');
+	return p ? p + 1 : path;
+}
+
+/* read and answer one request */
+void serve_client(int fd, struct config *cfg, struct load *loads, int nb,
+                  struct cache *cache, struct server *srv)
+{
+	char req[SERVE_REQ_SIZE];
+	char hdr[512];
+	char etag[32];
+	struct template *tpl;
+	struct memimage *img;
+	struct outbuf *body = NULL;
+	const char *type = NULL;
+	const char *status;
+	char *path;
+	char *end;
+	char *inm;
+	char *p;
+	size_t len = 0;
+	ssize_t ret;
+	int head;
+	int t;
+
+	/* the request line and the headers */
+	while (1) {
+		ret = recv(fd, req + len, sizeof(req) - 1 - len, 0);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return;
+		len += ret;
+		req[len] = '\0';
+		if (strstr(req, "\r\n\r\n") != NULL || strstr(req, "\n\n") != NULL)
+			break;
+		if (len == sizeof(req) - 1)
+			return;
+	}
+
+	/* "GET /path HTTP/1.x" */
+	/**/ if (strncmp(req, "GET ", 4) == 0)
+		head = 0;
+	else if (strncmp(req, "HEAD ", 5) == 0)
+		head = 1;
+	else {
+		status = "405 Method Not Allowed";
+		goto error;
+	}
+	path = strchr(req, ' ') + 1;
+	end = path + strcspn(path, " ?\r\n");
+	if (*end == '\0') {
+		status = "400 Bad Request";
+		goto error;
+	}
+	*end = '\0';
+	inm = NULL;
+	for (p = end + 1; (p = strchr(p, '\n')) != NULL; ) {
+		p++;
+		if (strncasecmp(p, "If-None-Match:", 14) == 0) {
+			inm = p + 14;
+			inm[strcspn(inm, "\r\n")] = '\0';
+			break;
+		}
+	}
+
+	/* build again if the inputs changed */
+	t = serve_check(srv, nb);
+	if (t || memchr(srv->changed, 1, nb) != NULL)
+		rebuild(cfg, loads, nb, srv->changed, t, cache, &srv->out);
+
+	/* the images, by their name with or without the hash, or one of
+	 * the templates.
+	 */
+	if (*path == '/')
+		path++;
+	for (t = 0; body == NULL && t < srv->out.nb_img; t++) {
+		img = &srv->out.imgs[t];
+		if (strcmp(path, serve_base(img->output)) != 0 &&
+		    strcmp(path, serve_base(img->pattern)) != 0)
+			continue;
+		body = &img->png;
+		type = "image/png";
+		snprintf(etag, sizeof(etag), "\"%08x\"", img->hash);
+	}
+	for (tpl = cfg->templates, t = 0; body == NULL && tpl != NULL; tpl = tpl->next, t++) {
+		if (strcmp(path, serve_base(tpl->out_file)) != 0)
+			continue;
+		body = &srv->out.tpls[t];
+		type = serve_type(tpl->out_file);
+		snprintf(etag, sizeof(etag), "\"%08x-%08x\"",
+		         srv->out.nb_img > 0 ? srv->out.imgs[0].hash : 0,
+		         (unsigned int)fnv64(FNV64_INIT, body->buf, body->len));
+	}
+	if (body == NULL) {
+		status = "404 Not Found";
+		goto error;
+	}
+
+	/* conditional request */
+	if (inm != NULL && (strstr(inm, etag) != NULL || strchr(inm, '*') != NULL)) {
+		len = snprintf(hdr, sizeof(hdr),
+		               "HTTP/1.1 304 Not Modified\r\n"
+		               "ETag: %s\r\n"
+		               "Cache-Control: no-cache\r\n"
+		               "Connection: close\r\n"
+		               "\r\n", etag);
+		serve_send(fd, hdr, len);
+		return;
+	}
+
+	len = snprintf(hdr, sizeof(hdr),
+	               "HTTP/1.1 200 OK\r\n"
+	               "Content-Type: %s\r\n"
+	               "Content-Length: %zu\r\n"
+	               "ETag: %s\r\n"
+	               "Cache-Control: no-cache\r\n"
+	               "Connection: close\r\n"
+	               "\r\n", type, body->len, etag);
+	if (serve_send(fd, hdr, len) < 0 || head)
+		return;
+	serve_send(fd, body->buf, body->len);
+	return;
+
+error:
+	len = snprintf(hdr, sizeof(hdr),
+	               "HTTP/1.1 %s\r\n"
+	               "Content-Length: 0\r\n"
+	               "Connection: close\r\n"
+	               "\r\n", status);
+	serve_send(fd, hdr, len);
+}
+
+/* build in memory, then answer the requests, never returns */
+void serve_loop(struct config *cfg, struct load *loads, int nb, struct cache *cache)
+{
+	struct server srv;
+	struct timeval tv;
+	struct template *tpl;
+	int fd;
+	int i;
+
+	memset(&srv, 0, sizeof(srv));
+	srv.nb_files = nb + cfg->nb_deps;
+	srv.files = calloc(sizeof(struct fileinfo), srv.nb_files + 1);
+	srv.changed = calloc(1, nb + 1);
+	for (tpl = cfg->templates; tpl != NULL; tpl = tpl->next)
+		srv.out.nb_tpl++;
+	srv.out.tpls = calloc(sizeof(struct outbuf), srv.out.nb_tpl + 1);
+	if (srv.files == NULL || srv.changed == NULL || srv.out.tpls == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (i=0; i<srv.nb_files; i++) {
+		srv.files[i].path = i < nb ? (char *)loads[i].name : cfg->deps[i - nb];
+		file_stat(srv.files[i].path, &srv.files[i]);
+	}
+
+	build(cfg, loads, nb, cache, &srv.out);
+
+	srv.fd = serve_listen(cfg->serve);
+	fprintf(stderr, "serving \"%s\" on %s\n",
+	        srv.out.nb_img > 0 ? serve_base(srv.out.imgs[0].output) : "", cfg->serve);
+
+	/* a client which does not send its request is dropped */
+	tv.tv_sec = 5;
+	tv.tv_usec = 0;
+	while (1) {
+		fd = accept(srv.fd, NULL, NULL);
+		if (fd < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			fprintf(stderr, "cannot accept connection: %s\n", strerror(errno));
+			exit(1);
+		}
+		setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+		serve_client(fd, cfg, loads, nb, cache, &srv);
+		close(fd);
+	}
 }
 
 int main(int argc, char *argv[])
 {
-	int smin = 0;
-	int ymax = 0;
-	int xmin = 0;
-	int larg;
 	int i;
-	struct surface *surf;
-	struct node **pool;
-	struct node *node;
-	int x;
-	int y;
-	int top = 0;
 	int nb_img;
 	int idx = 0;
-	int do_break;
+	struct config cfg;
 	char *in = NULL;
 	char *hdr = NULL;
 	char *foot = NULL;
 	const char *out;
-	struct template *templates = NULL;
 	struct template *tpl;
 	char *error;
-	int qual = 5;
-	int interlace = 0;
 	struct color _alpha;
-	struct color *alpha = NULL;
-	int do_crop = 0;
-	struct node stnode;
-	struct general gen;
-	char *p;
-	char hashstr[9];
-
-	/* memoire pour le tri */
-	pool = calloc(sizeof(struct node *), argc - 1);
+	struct load *loads;
+	struct cache cache;
+	char **inputs;
+	struct stats_clock t0;
+	long long max;
+	int scale;
+	int first;
+	int j;
+
+	memset(&cfg, 0, sizeof(cfg));
+	cfg.qual = 5;
+	cfg.pack = PACK_FIRSTFIT;
+	cfg.threads = 1;
+	cfg.scales[0] = 1;
+	cfg.nb_scales = 1;
+	cfg.options = FNV64_INIT;
 
 	/* load options */
 	for (i=1; i<argc; i++) {
@@ -1107,7 +6551,7 @@ int main(int argc, char *argv[])
 				usage();
 				exit(1);
 			}
-			gen.output = strdup(argv[i]);
+			cfg.output = argv[i];
 		}
 
 		/*
@@ -1133,6 +6577,13 @@ int main(int argc, char *argv[])
 			}
 			out = argv[i];
 
+			/* keep argv unchanged, it is the cache key */
+			in = strdup(in);
+			if (in == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+
 			/* Split input template */
 			if (in) {
 				hdr = strchr(in, ':');
@@ -1149,8 +6600,20 @@ int main(int argc, char *argv[])
 			}
 
 			tpl = load_tpl(in, hdr, foot, out);
-			tpl->next = templates;
-			templates = tpl;
+			tpl->next = cfg.templates;
+			cfg.templates = tpl;
+
+			/* the templates files are dependencies of the build */
+			cfg.deps = realloc(cfg.deps, sizeof(char *) * (cfg.nb_deps + 3));
+			if (cfg.deps == NULL) {
+				fprintf(stderr, "out of memory\n");
+				exit(1);
+			}
+			cfg.deps[cfg.nb_deps++] = in;
+			if (hdr)
+				cfg.deps[cfg.nb_deps++] = hdr;
+			if (foot)
+				cfg.deps[cfg.nb_deps++] = foot;
 		}
 
 		/*
@@ -1165,13 +6628,13 @@ int main(int argc, char *argv[])
 				usage();
 				exit(1);
 			}
-			qual = strtol(argv[i], &error, 10);
-			if (*error != '\0' || qual < 1 || qual > 6) {
+			cfg.qual = strtol(argv[i], &error, 10);
+			if (*error != '\0' || cfg.qual < 1 || cfg.qual > 6) {
 				fprintf(stderr, "option -q expect a value from 1 to 6\n");
 				usage();
 				exit(1);
 			}
-			qual--;
+			cfg.qual--;
 		}
 
 		/*
@@ -1180,7 +6643,7 @@ int main(int argc, char *argv[])
 		 *
 		 */
 		else if (strcmp(argv[i], "-i") == 0) {
-			interlace = 1;
+			cfg.interlace = 1;
 		}
 
 		/*
@@ -1200,8 +6663,8 @@ int main(int argc, char *argv[])
 				usage();
 				exit(1);
 			}
-			alpha = &_alpha;
-			if (color_conv(argv[i], alpha) < 0)  {
+			cfg.alpha = &_alpha;
+			if (color_conv(argv[i], cfg.alpha) < 0)  {
 				fprintf(stderr, "option -na expect a value rrggbb\n");
 				usage();
 				exit(1);
@@ -1214,172 +6677,398 @@ int main(int argc, char *argv[])
 		 *
 		 */
 		else if (strcmp(argv[i], "-c") == 0) {
-			do_crop = 1;
+			cfg.do_crop = 1;
 		}
 
 		/*
-		 * 
-		 * end of option, now load images
+		 *
+		 * build cache
 		 *
 		 */
-		else
-			break;
-	}
+		else if (strcmp(argv[i], "--cache") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option --cache expect file\n");
+				usage();
+				exit(1);
+			}
+			cfg.cache_file = argv[i];
+		}
 
-	/* no input files */
-	if (i >= argc) {
-		fprintf(stderr, "no input files\n");
-		usage();
-		exit(1);
-	}
+		/*
+		 *
+		 * stable layout
+		 *
+		 */
+		else if (strcmp(argv[i], "--stable") == 0) {
+			cfg.stable = 1;
+		}
 
-	/* check configuration */
-	if (gen.output == NULL) {
-		fprintf(stderr, "no outimage\n");
-		usage();
-		exit(1);
-	}
+		/*
+		 *
+		 * watch mode
+		 *
+		 */
+		else if (strcmp(argv[i], "--watch") == 0) {
+			cfg.watch = 1;
+		}
 
-	/* number of images */
-	nb_img = argc - i;
+		/*
+		 *
+		 * server mode
+		 *
+		 */
+		else if (strcmp(argv[i], "--serve") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option --serve expect a socket path or a port\n");
+				usage();
+				exit(1);
+			}
+			cfg.serve = argv[i];
+		}
 
-	/* charge les images */
-	for (; i<argc; i++) {
+		/*
+		 *
+		 * list of the input images
+		 *
+		 */
+		else if (strcmp(argv[i], "-l") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option -l expect file\n");
+				usage();
+				exit(1);
+			}
+			cfg.list = argv[i];
+		}
 
-		/* open png image */
-		node = openimage(argv[i]);
-		if (node == NULL) {
-			nb_img --;
-			continue;
+		/*
+		 *
+		 * statistics
+		 *
+		 */
+		else if (strcmp(argv[i], "--stats") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option --stats expect file\n");
+				usage();
+				exit(1);
+			}
+			cfg.stats_file = argv[i];
+		}
+		else if (strcmp(argv[i], "--trace") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option --trace expect file\n");
+				usage();
+				exit(1);
+			}
+			cfg.trace_file = argv[i];
 		}
 
-		/* crop image */
-		if (do_crop)
-			crop(node);
+		/*
+		 *
+		 * sheet limits
+		 *
+		 */
+		else if (strcmp(argv[i], "--max-width") == 0 ||
+		         strcmp(argv[i], "--max-height") == 0 ||
+		         strcmp(argv[i], "--max-pixels") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option %s expect a number of pixels\n", argv[i - 1]);
+				usage();
+				exit(1);
+			}
+			max = strtoll(argv[i], &error, 10);
+			if (*error != '\0' || max < 1 || max > (1LL << 40)) {
+				fprintf(stderr, "option %s expect a number of pixels\n", argv[i - 1]);
+				usage();
+				exit(1);
+			}
+			/**/ if (strcmp(argv[i - 1], "--max-width") == 0)
+				cfg.max_width = max < INT_MAX ? max : INT_MAX;
+			else if (strcmp(argv[i - 1], "--max-height") == 0)
+				cfg.max_height = max < INT_MAX ? max : INT_MAX;
+			else
+				cfg.max_pixels = max;
+		}
 
-		/* copy name */
-		node->name = argv[i];
-		node->azname = do_azname(argv[i]);
+		/*
+		 *
+		 * output densities
+		 *
+		 */
+		else if (strcmp(argv[i], "--scales") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option --scales expect a list of scales\n");
+				usage();
+				exit(1);
+			}
+			cfg.nb_scales = 0;
+			error = argv[i];
+			do {
+				scale = strtol(error, &error, 10);
+				if ((*error != '\0' && *error != ',') ||
+				    scale < 1 || scale > SCALE_MAX) {
+					fprintf(stderr, "option --scales expect a list of scales between 1 and %d\n",
+					        SCALE_MAX);
+					usage();
+					exit(1);
+				}
 
-		/* index png image */
-		pool[idx] = node;
-		idx++;
+				/* sorted from the biggest, once each */
+				for (j=0; j<cfg.nb_scales && cfg.scales[j] > scale; j++);
+				if (j < cfg.nb_scales && cfg.scales[j] == scale)
+					continue;
+				memmove(&cfg.scales[j + 1], &cfg.scales[j],
+				        sizeof(int) * (cfg.nb_scales - j));
+				cfg.scales[j] = scale;
+				cfg.nb_scales++;
+			} while (*error++ == ',');
+		}
 
-		/* calcul de la surface minimale */
-		smin += node->surface;
+		/*
+		 *
+		 * palette output
+		 *
+		 */
+		else if (strcmp(argv[i], "-P") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option -P expect a number of colors\n");
+				usage();
+				exit(1);
+			}
+			cfg.colors = strtol(argv[i], &error, 10);
+			if (*error != '\0' || cfg.colors < 2 || cfg.colors > 256) {
+				fprintf(stderr, "option -P expect a number of colors between 2 and 256\n");
+				usage();
+				exit(1);
+			}
+		}
 
-		/* calcul de la largeur minimale */
-		if (node->width > xmin)
-			xmin = node->width;
+		/*
+		 *
+		 * encoding optimization level
+		 *
+		 */
+		else if (strcmp(argv[i], "-O") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option -O expect a level\n");
+				usage();
+				exit(1);
+			}
+			cfg.optimize = strtol(argv[i], &error, 10);
+			if (*error != '\0' || cfg.optimize < 0 || cfg.optimize > 3) {
+				fprintf(stderr, "option -O expect a level between 0 and 3\n");
+				usage();
+				exit(1);
+			}
+		}
 
-		/* hauteur maximale */
-		ymax += node->height;
-	}
+		/*
+		 *
+		 * number of threads
+		 *
+		 */
+		else if (strcmp(argv[i], "-j") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option -j expect a number of threads\n");
+				usage();
+				exit(1);
+			}
+			cfg.threads = strtol(argv[i], &error, 10);
+			if (*error != '\0' || cfg.threads < 0) {
+				fprintf(stderr, "option -j expect a number of threads\n");
+				usage();
+				exit(1);
+			}
+			if (cfg.threads == 0)
+				cfg.threads = sysconf(_SC_NPROCESSORS_ONLN);
+			if (cfg.threads < 1)
+				cfg.threads = 1;
+		}
 
-	/* nothing to do */
-	if (nb_img == 0)
-		exit(0);
+		/*
+		 *
+		 * streaming output
+		 *
+		 */
+		else if (strcmp(argv[i], "-s") == 0) {
+			cfg.stream = 1;
+		}
 
-	/* Calcule la largeur */
-	larg = sqrt(smin) + 1;
-	if (larg < xmin)
-		larg = xmin;
+		/*
+		 *
+		 * deduplication
+		 *
+		 */
+		else if (strcmp(argv[i], "-d") == 0) {
+			cfg.do_dedupe = 1;
+		}
 
-	/* memoire pour la surface de placement */
-	surf = calloc(sizeof(struct surface), larg * ymax);
+		/*
+		 *
+		 * packing algorithm
+		 *
+		 */
+		else if (strcmp(argv[i], "-p") == 0) {
+			i++;
+			if (i >= argc) {
+				fprintf(stderr, "option -p expect firstfit, skyline or maxrects\n");
+				usage();
+				exit(1);
+			}
+			/**/ if (strcmp(argv[i], "firstfit") == 0)
+				cfg.pack = PACK_FIRSTFIT;
+			else if (strcmp(argv[i], "skyline") == 0)
+				cfg.pack = PACK_SKYLINE;
+			else if (strcmp(argv[i], "maxrects") == 0)
+				cfg.pack = PACK_MAXRECTS;
+			else {
+				fprintf(stderr, "option -p expect firstfit, skyline or maxrects\n");
+				usage();
+				exit(1);
+			}
+		}
 
-	/* on ordone les images */
-	qsort(pool, nb_img, sizeof(struct node *), compar);
+		/*
+		 * 
+		 * end of option, now load images
+		 *
+		 */
+		else
+			break;
+	}
 
-	/* on va placer les locs par ordre de taille */
-	for (i=0; i<nb_img; i++) {
+	/* the previous layout is read from the cache */
+	if (cfg.stable && cfg.cache_file == NULL) {
+		fprintf(stderr, "option --stable needs --cache\n");
+		usage();
+		exit(1);
+	}
 
-		/* get node */
-		node = pool[i];
+	/* the previous places are only in the first sheet */
+	if (cfg.stable && (cfg.max_width || cfg.max_height || cfg.max_pixels)) {
+		fprintf(stderr, "option --stable cannot be used with the sheet limits\n");
+		usage();
+		exit(1);
+	}
 
-		/* on place le noeud
-		 * on scanne l'espace libre de gaucha a droite puis de haut en bas
-		 */
-		do_break = 0;
-		for (y=0; y<ymax-node->height+1; y++) {
-			for (x=0; x<larg-node->width+1; x++) {
+	/* the input images are at the biggest scale. The previous places are
+	 * in its pixels, not in CSS pixels.
+	 */
+	cfg.density = cfg.scales[0];
+	if (cfg.stable && cfg.density > 1) {
+		fprintf(stderr, "option --stable cannot be used with --scales\n");
+		usage();
+		exit(1);
+	}
 
-				/* on verifie l'espace libre 
-				 * on scanne uniquement la zone dans laquelle l'image
-				 * peut potentiellement contenir
-				 */
-				if (check_size(surf, larg, x, y, node->width, node->height)) {
-					fill(surf, larg, x, y, node);
+	/* the server builds on request */
+	if (cfg.watch && cfg.serve) {
+		fprintf(stderr, "options --watch and --serve are exclusive\n");
+		usage();
+		exit(1);
+	}
 
-					/* on met  jour la hauteur de l'image */
-					if (top < y + node->height)
-						top = y + node->height;
+	/* the input images, from the command line then from the list */
+	nb_img = argc - i;
+	inputs = &argv[i];
+	first = i;
+	if (cfg.list)
+		inputs = load_list(cfg.list, inputs, &nb_img);
 
-					/* on note les coordonnes de destination */
-					node->dest_x = x;
-					node->dest_y = y;
+	/* no input files */
+	if (nb_img == 0) {
+		fprintf(stderr, "no input files\n");
+		usage();
+		exit(1);
+	}
 
-					/* fin du scan pour cette image */
-					do_break = 1;
-					break;
-				}
-			}
-			if (do_break)
-				break;
-		}
+	/* check configuration */
+	if (cfg.output == NULL) {
+		fprintf(stderr, "no outimage\n");
+		usage();
+		exit(1);
 	}
 
-	/* img sign */
-	gen.hash = 0;
-	for (i = 0; i < larg * top; i++) {
-		gen.hash ^= hash( surf[i].r       ) |
-		                ( surf[i].g << 8  ) |
-		                ( surf[i].b << 16 ) |
-		                ( surf[i].a << 24 );
+	/* when the images are not cropped and the canvas is used, the layout
+	 * only needs the images size: the images are decoded once placed,
+	 * directly into the canvas. The deduplication and the lower scales
+	 * need the pixels, and the watch and server modes keep them in memory.
+	 */
+	cfg.direct = !cfg.do_crop && !cfg.stream && !cfg.do_dedupe && !cfg.watch && !cfg.serve &&
+	             cfg.nb_scales == 1;
+
+	/* the timeline starts here, the main thread is the first one */
+	if (cfg.trace_file) {
+		trace.on = 1;
+		trace.start = stats_now();
+		trace_tid = ++trace.nb_threads;
 	}
 
-	gen.hash ^= hash(larg);
-	gen.hash ^= hash(top);
-	gen.hash ^= hash(qual);
-	if (alpha)
-		gen.hash ^= hash(1);
+	/* nothing changed since the previous build */
+	memset(&cache, 0, sizeof(cache));
+	if (cfg.cache_file) {
+
+		/* the options which change the output are the cache key */
+		for (i=1; i<first; i++) {
+			if (strcmp(argv[i], "-j") == 0 || strcmp(argv[i], "--cache") == 0) {
+				i++;
+				continue;
+			}
+			if (strcmp(argv[i], "--watch") == 0)
+				continue;
+			if (strcmp(argv[i], "--serve") == 0 || strcmp(argv[i], "--stats") == 0 ||
+			    strcmp(argv[i], "--trace") == 0) {
+				i++;
+				continue;
+			}
+			cfg.options = fnv64(cfg.options, argv[i], strlen(argv[i]) + 1);
+		}
+
+		cache_load(&cache, cfg.cache_file);
+		if (!cfg.watch && !cfg.serve &&
+		    cache_uptodate(&cache, cfg.options, inputs, nb_img, cfg.deps, cfg.nb_deps))
+			exit(0);
+	}
 
-	/* Apply hash on the output images */
-	p = strstr(gen.output, "XXXXXXXX");
-	if (p) {
-		snprintf(hashstr, 9, "%08x", gen.hash);
-		memcpy(p, hashstr, 8);
+	/* charge les images */
+	loads = calloc(sizeof(struct load), nb_img);
+	if (loads == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
 	}
+	for (idx=0; idx<nb_img; idx++) {
+		loads[idx].name = inputs[idx];
+		if (cfg.cache_file && cache.crop == cfg.do_crop)
+			loads[idx].cached = cache_lookup(&cache, inputs[idx]);
+	}
+	stats_start(&t0);
+	if (load_images(&cfg, loads, nb_img) > 0)
+		exit(1);
+	stats_end(&t0, PHASE_LOAD);
 
+	/* the outputs are only in memory */
+	if (cfg.serve)
+		serve_loop(&cfg, loads, nb_img, &cache);
 
-	/* Dump header templates file */
-	stnode.width = 0;
-	stnode.height = 0;
-	stnode.dest_x = 0;
-	stnode.dest_y = 0;
-	stnode.name = "";
-	stnode.azname = "";
-	for (tpl = templates;
-	     tpl != NULL;
-	     tpl = tpl->next)
-		exec_tpl(tpl, 0, &stnode, &gen, 0);
+	build(&cfg, loads, nb_img, &cache, NULL);
 
-	/* on parcours les images pour executer les templates */
-	for (i=0; i<nb_img; i++) {
-		for (tpl = templates;
-		     tpl != NULL; 
-		     tpl = tpl->next)
-			exec_tpl(tpl, 1, pool[i], &gen, i);
-	}
+	/* build again on each change */
+	if (cfg.watch)
+		watch_loop(&cfg, loads, nb_img, &cache);
 
-	/* close templates */
-	for (tpl = templates;
-	     tpl != NULL; 
-	     tpl = tpl->next)
-		close_tpl(tpl, &gen);
+	free(loads);
 
-	/* draw png outpout image */
-	drawpng(surf, larg, top, qual, interlace, alpha, gen.output);
+	/* release the decoded images */
+	arena_release(&img_arena);
 
 	return 0;
 }
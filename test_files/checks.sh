@@ -0,0 +1,177 @@
+#!/bin/sh
+#
+# checks of the outputs of imgcssmap, run by "make test" from the top
+# directory. Each check prints its name and "ok", or the failure, and the
+# script exits with an error if one of them fails.
+#
+
+IMGS="test_images/credit_card_icons/*.png test_images/glyphicons/*.png
+      test_images/plastic_new_year/*/*.png test_images/woody_social_icons/*.png"
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+failed=0
+
+fail() {
+	echo "$1: FAILED, $2"
+	failed=1
+}
+
+# size of a file in bytes
+size() {
+	wc -c < "$1" | tr -d ' '
+}
+
+# the palette image has the same size with one and with several threads:
+# the parallel encoder uses the libpng defaults of the palette images.
+check_palette_threads() {
+	./imgcssmap -P 64 -j 1 -o "$TMP/p1.png" $IMGS 2>/dev/null || { fail palette_threads "-j 1"; return; }
+	./imgcssmap -P 64 -j 4 -o "$TMP/p4.png" $IMGS 2>/dev/null || { fail palette_threads "-j 4"; return; }
+	s1=$(size "$TMP/p1.png")
+	s4=$(size "$TMP/p4.png")
+	if [ $((s4 * 100)) -gt $((s1 * 102)) ]; then
+		fail palette_threads "$s4 bytes with -j 4, $s1 bytes with -j 1"
+		return
+	fi
+	echo "palette_threads: ok"
+}
+
+# width of a png image, from its IHDR chunk
+png_width() {
+	od -An -tu1 -j16 -N4 "$1" | awk '{ print (($1 * 256 + $2) * 256 + $3) * 256 + $4 }'
+}
+
+# with images narrower than --max-width, no sheet is wider. An image wider
+# than the limit is an error.
+check_max_width() {
+	small="test_images/credit_card_icons/*.png test_images/glyphicons/*.png
+	       test_images/woody_social_icons/*.png"
+	./imgcssmap --max-width 150 -o "$TMP/w.png" $small 2>/dev/null || { fail max_width "build"; return; }
+	for f in "$TMP"/w*.png; do
+		if [ $(png_width "$f") -gt 150 ]; then
+			fail max_width "$f is $(png_width "$f") pixels wide"
+			return
+		fi
+	done
+	if ./imgcssmap --max-width 150 -o "$TMP/x.png" $IMGS 2>/dev/null; then
+		fail max_width "the 256 pixels images are accepted"
+		return
+	fi
+	echo "max_width: ok"
+}
+
+# bit depth and color type of a png image, from its IHDR chunk
+png_format() {
+	od -An -tu1 -j24 -N2 "$1" | awk '{ print $1, $2 }'
+}
+
+# the smallest lossless format: each pattern of pngpix is written with the
+# expected depth, color type and tRNS chunk, and decodes to the pixels of
+# the input, with the parallel encoder, the interlace, the streaming mode
+# and -O too.
+check_formats() {
+	for f in "gray1 1 0 0" "gray4 4 0 0" "gray8 8 0 0" "grayalpha 8 4 0" \
+	         "key 8 2 1" "palette 8 3 1" "rgb 8 2 0" "rgba 8 6 0"; do
+		set -- $f
+		./test_files/pngpix make $1 "$TMP/$1.png" || { fail formats "pattern $1"; return; }
+		./test_files/pngpix dump "$TMP/$1.png" "$TMP/$1.in"
+		for opt in "-j 1" "-j 4" "-i" "-s" "-O 1"; do
+			./imgcssmap $opt -o "$TMP/f.png" "$TMP/$1.png" 2>/dev/null || { fail formats "$1 $opt"; return; }
+			if [ "$(png_format "$TMP/f.png")" != "$2 $3" ]; then
+				fail formats "$1 $opt: depth and color type $(png_format "$TMP/f.png")"
+				return
+			fi
+			if grep -q tRNS "$TMP/f.png"; then trns=1; else trns=0; fi
+			if [ $trns != $4 ]; then
+				fail formats "$1 $opt: tRNS chunk $trns"
+				return
+			fi
+			./test_files/pngpix dump "$TMP/f.png" "$TMP/f.out"
+			if ! cmp -s "$TMP/$1.in" "$TMP/f.out"; then
+				fail formats "$1 $opt: the pixels differ"
+				return
+			fi
+		done
+	done
+	echo "formats: ok"
+}
+
+# build the test images with the options "$@" in the directory $TMP/$1,
+# with the hash in the name of the output image and two templates.
+build() {
+	dir="$TMP/$1"
+	shift
+	mkdir -p "$dir"
+	./imgcssmap "$@" -o "$dir/o-XXXXXXXX.png" -t test_files/a.css.tpl "$dir/a.css" \
+		-t test_files/test.txt.tpl "$dir/t.txt" $IMGS 2>/dev/null
+}
+
+# the builds $1 and $2 have the same files with the same content. With $3,
+# the output images only need the same pixels.
+same() {
+	[ "$(ls "$TMP/$1")" = "$(ls "$TMP/$2")" ] || return 1
+	for f in $(ls "$TMP/$1"); do
+		if [ -n "$3" ] && [ "${f%.png}" != "$f" ]; then
+			./test_files/pngpix dump "$TMP/$1/$f" "$TMP/$1.pix"
+			./test_files/pngpix dump "$TMP/$2/$f" "$TMP/$2.pix"
+			cmp -s "$TMP/$1.pix" "$TMP/$2.pix" || return 1
+			continue
+		fi
+		cmp -s "$TMP/$1/$f" "$TMP/$2/$f" || return 1
+	done
+}
+
+# with several threads, the image has the same pixels and the same hash,
+# and the templates rendered in parallel are the same.
+check_threads() {
+	build j1 -j 1 && build j4 -j 4 || { fail threads "build"; return; }
+	same j1 j4 pixels || { fail threads "-j 4 differs from -j 1"; return; }
+	echo "threads: ok"
+}
+
+# for each packer, the streaming mode gives the same files, and the same
+# layout and hash with several threads.
+check_layout() {
+	for p in firstfit skyline maxrects; do
+		build $p -p $p && build $p-s -p $p -s && build $p-s4 -p $p -s -j 4 ||
+			{ fail layout "build -p $p"; return; }
+		same $p $p-s || { fail layout "-p $p -s differs"; return; }
+		same $p $p-s4 pixels || { fail layout "-p $p -s -j 4 differs"; return; }
+	done
+	echo "layout: ok"
+}
+
+# --scales 1 gives the same files as without --scales.
+check_scales() {
+	build noscale && build scale1 --scales 1 || { fail scales "build"; return; }
+	same noscale scale1 || { fail scales "--scales 1 differs"; return; }
+	echo "scales: ok"
+}
+
+# with --stable, the images kept from the previous build keep their place
+# when other ones are removed, and a build without change is the same.
+check_stable() {
+	all="test_images/credit_card_icons/*.png test_images/woody_social_icons/*.png"
+	kept=$(ls $all | sed 1,4d)
+	echo '$(name) $(offsetx) $(offsety)' > "$TMP/pos.tpl"
+	for i in 1 2 3; do
+		if [ $i = 1 ]; then set -- $all; else set -- $kept; fi
+		./imgcssmap --stable --cache "$TMP/cache" -t "$TMP/pos.tpl" "$TMP/pos$i.txt" \
+			-o "$TMP/s.png" "$@" 2>/dev/null || { fail stable "build $i"; return; }
+	done
+	if [ $(grep -F -x -f "$TMP/pos1.txt" "$TMP/pos2.txt" | wc -l) != $(echo "$kept" | wc -l) ]; then
+		fail stable "the kept images moved"
+		return
+	fi
+	cmp -s "$TMP/pos2.txt" "$TMP/pos3.txt" || { fail stable "the layout changed without change"; return; }
+	echo "stable: ok"
+}
+
+check_palette_threads
+check_max_width
+check_formats
+check_threads
+check_layout
+check_scales
+check_stable
+
+exit $failed
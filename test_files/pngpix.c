@@ -0,0 +1,245 @@
+/*
+ * Copyright (c) 2011-2012 Thierry FOURNIER
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version
+ * 2 of the License.
+ *
+ */
+
+/*
+ * Pixels of png images, for the checks of test_files/checks.sh.
+ *
+ *   pngpix dump in.png out
+ *   pngpix make pattern out.png
+ *
+ * "dump" decodes any png image (any color type, depth or interlace) and
+ * writes its size then its pixels in RGBA 8 bits, so two images with
+ * the same pixels give the same dump whatever their format. The color
+ * of the fully transparent pixels is not kept.
+ *
+ * "make" writes a RGBA 64x32 image whose pixels need the format named
+ * by <pattern>, see patterns[].
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <png.h>
+
+#define WIDTH  64
+#define HEIGHT 32
+
+static const char *patterns[] = {
+	"gray1",       /* black and white */
+	"gray4",       /* 16 gray levels */
+	"gray8",       /* more gray levels */
+	"grayalpha",   /* gray levels with alpha */
+	"key",         /* more than 256 colors, alpha 0 or 255 */
+	"palette",     /* 256 colors with alpha */
+	"rgb",         /* more than 256 colors, opaque */
+	"rgba",        /* more than 256 colors with alpha */
+	NULL
+};
+
+void dump(const char *in_file, const char *out_file)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_bytep *rows;
+	png_bytep pix;
+	png_uint_32 width;
+	png_uint_32 height;
+	FILE *fp;
+	FILE *out;
+	size_t x;
+	int y;
+
+	fp = fopen(in_file, "rb");
+	if (fp == NULL) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n", in_file, strerror(errno));
+		exit(1);
+	}
+	png_ptr = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_create_info_struct(png_ptr);
+	if (png_ptr == NULL || info_ptr == NULL || setjmp(png_jmpbuf(png_ptr))) {
+		fprintf(stderr, "cannot read file \"%s\"\n", in_file);
+		exit(1);
+	}
+	png_init_io(png_ptr, fp);
+	png_read_info(png_ptr, info_ptr);
+
+	/* any format to RGBA 8 bits */
+	png_set_expand(png_ptr);
+	png_set_strip_16(png_ptr);
+	png_set_gray_to_rgb(png_ptr);
+	png_set_add_alpha(png_ptr, 0xff, PNG_FILLER_AFTER);
+	png_set_interlace_handling(png_ptr);
+	png_read_update_info(png_ptr, info_ptr);
+
+	width = png_get_image_width(png_ptr, info_ptr);
+	height = png_get_image_height(png_ptr, info_ptr);
+	rows = malloc(sizeof(png_bytep) * height);
+	if (rows == NULL) {
+		fprintf(stderr, "out of memory\n");
+		exit(1);
+	}
+	for (y=0; y<height; y++) {
+		rows[y] = malloc((size_t)width * 4);
+		if (rows[y] == NULL) {
+			fprintf(stderr, "out of memory\n");
+			exit(1);
+		}
+	}
+	png_read_image(png_ptr, rows);
+	png_destroy_read_struct(&png_ptr, &info_ptr, NULL);
+	fclose(fp);
+
+	out = fopen(out_file, "wb");
+	if (out == NULL) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n", out_file, strerror(errno));
+		exit(1);
+	}
+	fprintf(out, "%u %u\n", (unsigned int)width, (unsigned int)height);
+	for (y=0; y<height; y++) {
+		for (x=0; x<width; x++) {
+			pix = &rows[y][x * 4];
+			if (pix[3] == 0)
+				memset(pix, 0, 4);
+		}
+		fwrite(rows[y], 4, width, out);
+		free(rows[y]);
+	}
+	free(rows);
+	if (fclose(out) != 0) {
+		fprintf(stderr, "cannot write file \"%s\": %s\n", out_file, strerror(errno));
+		exit(1);
+	}
+}
+
+/* the pixel (x, y) of the pattern <p> */
+void pattern_pixel(int p, int x, int y, png_bytep pix)
+{
+	pix[3] = 0xff;
+	switch (p) {
+	case 0:
+		pix[0] = (x ^ y) & 4 ? 0xff : 0;
+		pix[1] = pix[2] = pix[0];
+		break;
+	case 1:
+		pix[0] = 17 * ((x + y) % 16);
+		pix[1] = pix[2] = pix[0];
+		break;
+	case 2:
+		pix[0] = x * 4 + y;
+		pix[1] = pix[2] = pix[0];
+		break;
+	case 3:
+		pix[0] = x * 4;
+		pix[1] = pix[2] = pix[0];
+		pix[3] = y * 8 + 7;
+		break;
+	case 4:
+		pix[0] = x * 4;
+		pix[1] = y * 8;
+		pix[2] = 0x80;
+		if ((x + y) % 7 == 0)
+			memset(pix, 0, 4);
+		break;
+	case 5:
+		pix[0] = (x % 8) * 32;
+		pix[1] = (y % 8) * 32;
+		pix[2] = 0x40;
+		pix[3] = (x / 8 % 4) * 64 + 63;
+		break;
+	case 6:
+		pix[0] = x * 4;
+		pix[1] = y * 8;
+		pix[2] = x * y;
+		break;
+	default:
+		pix[0] = x * 4;
+		pix[1] = y * 8;
+		pix[2] = x * y;
+		pix[3] = x * 3 + y + 1;
+		break;
+	}
+}
+
+void make(const char *pattern, const char *name)
+{
+	png_structp png_ptr;
+	png_infop info_ptr;
+	png_byte row[WIDTH * 4];
+	FILE *fp;
+	int p;
+	int x;
+	int y;
+
+	for (p=0; patterns[p] != NULL; p++)
+		if (strcmp(patterns[p], pattern) == 0)
+			break;
+	if (patterns[p] == NULL) {
+		fprintf(stderr, "unknown pattern \"%s\"\n", pattern);
+		exit(1);
+	}
+
+	fp = fopen(name, "wb");
+	if (fp == NULL) {
+		fprintf(stderr, "cannot open file \"%s\": %s\n", name, strerror(errno));
+		exit(1);
+	}
+	png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	info_ptr = png_create_info_struct(png_ptr);
+	if (png_ptr == NULL || info_ptr == NULL || setjmp(png_jmpbuf(png_ptr))) {
+		fprintf(stderr, "cannot write file \"%s\"\n", name);
+		exit(1);
+	}
+	png_init_io(png_ptr, fp);
+	png_set_IHDR(png_ptr, info_ptr, WIDTH, HEIGHT, 8, PNG_COLOR_TYPE_RGB_ALPHA,
+	             PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info(png_ptr, info_ptr);
+	for (y=0; y<HEIGHT; y++) {
+		for (x=0; x<WIDTH; x++)
+			pattern_pixel(p, x, y, &row[x * 4]);
+		png_write_row(png_ptr, row);
+	}
+	png_write_end(png_ptr, NULL);
+	png_destroy_write_struct(&png_ptr, &info_ptr);
+	fclose(fp);
+}
+
+void usage(void)
+{
+	fprintf(stderr,
+	"\n"
+	"pngpix dump in.png out\n"
+	"pngpix make pattern out.png\n"
+	"\n"
+	"   dump     write the size and the RGBA pixels of 'in.png' in 'out'\n"
+	"   make     write a 64x32 image of the pattern 'gray1', 'gray4', 'gray8',\n"
+	"            'grayalpha', 'key', 'palette', 'rgb' or 'rgba'\n"
+	"\n"
+	);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 4) {
+		usage();
+		exit(1);
+	}
+
+	/**/ if (strcmp(argv[1], "dump") == 0)
+		dump(argv[2], argv[3]);
+	else if (strcmp(argv[1], "make") == 0)
+		make(argv[2], argv[3]);
+	else {
+		usage();
+		exit(1);
+	}
+	return 0;
+}